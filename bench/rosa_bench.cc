@@ -0,0 +1,337 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+#include <boost/format.hpp>
+
+#include "CLI/CLI.hpp"
+
+#include "cache.hh"
+#include "encounter.hh"
+#include "engine.hh"
+#include "instruction.hh"
+#include "map.hh"
+#include "parameters.hh"
+#include "state.hh"
+#include "version.hh"
+
+constexpr std::size_t STATE_COUNT = 4096;
+constexpr std::size_t ROUTE_SIZE = 1024;
+
+struct Result {
+	std::string name;
+	std::size_t iterations;
+	double seconds;
+};
+
+// Gives the benchmarks access to the internals of the engine.
+class Benchmark {
+	public:
+		static auto step(Engine * engine, State * state, int steps) -> Milliframes {
+			return engine->_step(state, nullptr, 0, steps);
+		}
+
+		// Returns the index of the PATH with the highest encounter rate.
+		static auto find_busiest_path(const Engine & engine) -> std::size_t {
+			std::size_t busiest{0};
+			int busiest_rate{-1};
+
+			for (std::size_t index{0}; index < engine._parameters.route.size(); index++) {
+				const auto & instruction{engine._parameters.route[index]};
+
+				if (instruction.type == InstructionType::Path) {
+					auto rate{engine._parameters.maps.get_map(instruction.map).encounter_rate};
+
+					if (rate > busiest_rate) {
+						busiest = index;
+						busiest_rate = rate;
+					}
+				}
+			}
+
+			return busiest;
+		}
+};
+
+// Loads a route and its data as rosa does, relative to the working directory.
+static auto load_parameters(const std::string & route_name, int maximum_steps) -> Parameters {
+	std::ifstream route_file{"data/routes/" + route_name + ".txt", std::ios_base::in};
+
+	if (!route_file.is_open()) {
+		throw std::runtime_error{"Failed to open the route " + route_name};
+	}
+
+	auto route{read_route(route_file)};
+	std::string data_key{"ff2us"};
+
+	for (const auto & instruction : route) {
+		if (instruction.type == InstructionType::Data) {
+			data_key = instruction.text;
+		} else if (instruction.type == InstructionType::Search && !instruction.search->is_valid()) {
+			throw std::runtime_error{"Invalid search expression in " + route_name + ": " + instruction.source};
+		}
+	}
+
+	std::ifstream encounters_file{"data/encounters/" + data_key + ".txt", std::ios_base::in};
+	std::ifstream maps_file{"data/maps/" + data_key + ".txt", std::ios_base::in};
+
+	if (!encounters_file.is_open() || !maps_file.is_open()) {
+		throw std::runtime_error{"Failed to open the data for " + data_key};
+	}
+
+	return Parameters{route, Encounters{encounters_file}, Maps{maps_file}, maximum_steps, false, false, true, -1, CacheType::Dynamic, "", 0, SolverType::Recursive, 1, false, false, OutputFormat::Text};
+}
+
+// Returns states spread over the route and the RNG, as a solve would visit.
+static auto generate_states(std::size_t count, std::mt19937_64 * random) -> std::vector<State> {
+	std::vector<State> states;
+
+	for (std::size_t i{0}; i < count; i++) {
+		State state{static_cast<int>((*random)() % RNG_SIZE)};
+		state.set_index((*random)() % ROUTE_SIZE);
+		state.set_step_position(static_cast<uint16_t>((*random)() % RNG_CYCLE_LENGTH));
+		state.set_remaining_segments(static_cast<uint16_t>((*random)() % 4)); // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+		for (auto encounters{(*random)() % RNG_SIZE}; encounters > 0; encounters--) {
+			state.advance_encounter();
+		}
+
+		states.push_back(state);
+	}
+
+	return states;
+}
+
+class Runner {
+	public:
+		Runner(std::string filter, int repetitions) : _filter{std::move(filter)}, _repetitions{repetitions} {}
+
+		// Runs a benchmark, which performs the given number of iterations
+		// each time it is called, and keeps the fastest of the repetitions.
+		// The setup is run before each repetition and is not timed.
+		void run(const std::string & name, std::size_t iterations, const std::function<uint64_t()> & function, const std::function<void()> & setup = {}) {
+			if (name.find(_filter) == std::string::npos) {
+				return;
+			}
+
+			double best{0.0};
+
+			for (int repetition{0}; repetition < _repetitions; repetition++) {
+				if (setup) {
+					setup();
+				}
+
+				auto start{std::chrono::steady_clock::now()};
+				_checksum ^= function();
+				std::chrono::duration<double> elapsed{std::chrono::steady_clock::now() - start};
+
+				best = repetition == 0 ? elapsed.count() : std::min(best, elapsed.count());
+			}
+
+			std::cout << boost::format("%-32s%12d%12.3fs%14.1fns\n") % name % iterations % best % (best * 1e9 / static_cast<double>(iterations)); // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+			_results.push_back(Result{name, iterations, best});
+		}
+
+		void write(const std::string & filename) const {
+			std::ofstream output{filename, std::ios_base::out};
+
+			if (!output.is_open()) {
+				throw std::runtime_error{"Failed to open " + filename};
+			}
+
+			output << boost::format(R"({"rosa":"%s","checksum":%d,"benchmarks":[)") % ROSA_VERSION % _checksum;
+
+			for (std::size_t i{0}; i < _results.size(); i++) {
+				const auto & result{_results[i]};
+				output << boost::format(R"(%s{"name":"%s","iterations":%d,"seconds":%.9f,"nanoseconds_per_iteration":%.3f})") % (i > 0 ? "," : "") % result.name % result.iterations % result.seconds % (result.seconds * 1e9 / static_cast<double>(result.iterations)); // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+			}
+
+			output << "]}\n";
+		}
+
+	private:
+		std::string _filter;
+		int _repetitions;
+		uint64_t _checksum{0};
+		std::vector<Result> _results;
+};
+
+auto main(int argc, char ** argv) -> int {
+	std::string output_filename{"rosa-bench.json"};
+	std::string filter;
+	int repetitions{3};
+	std::vector<int> maximum_steps{0, 8, 64}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+	CLI::App app{std::string{"Rosa Benchmarks "} + std::string{ROSA_VERSION}};
+
+	app.add_option("-o,--output", output_filename, "The file to write the results to, as JSON")
+		->capture_default_str();
+	app.add_option("-f,--filter", filter, "Only run the benchmarks whose names contain this text");
+	app.add_option("-n,--repetitions", repetitions, "Number of times to run each benchmark, keeping the fastest")
+		->capture_default_str();
+
+	try {
+		app.parse(argc, argv);
+	} catch (const CLI::ParseError & e) {
+		return app.exit(e);
+	}
+
+	Runner runner{filter, std::max(1, repetitions)};
+	std::mt19937_64 random{1}; // NOLINT(cert-msc32-c,cert-msc51-cpp)
+
+	try {
+		auto states{generate_states(STATE_COUNT, &random)};
+
+		runner.run("state/get-keys", 1U << 24U, [&states]() { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+			uint64_t checksum{0};
+
+			for (std::size_t i{0}; i < (1U << 24U); i++) { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+				const auto [key1, key2, key3] = states[i % STATE_COUNT].get_keys();
+				checksum += key1 ^ key2 ^ key3;
+			}
+
+			return checksum;
+		});
+
+		auto paladin{load_parameters("paladin", 0)};
+
+		{
+			Engine engine{paladin};
+			auto index{Benchmark::find_busiest_path(engine)};
+			const int steps{512};
+			const std::size_t passes{64};
+
+			runner.run("engine/step-512", STATE_COUNT * passes, [&engine, &states, index]() {
+				uint64_t checksum{0};
+
+				for (std::size_t pass{0}; pass < passes; pass++) {
+					for (auto state : states) {
+						state.set_index(index);
+						checksum += static_cast<uint64_t>(Benchmark::step(&engine, &state, steps).count());
+					}
+				}
+
+				return checksum;
+			});
+		}
+
+		for (const std::size_t size : {std::size_t{1} << 16U, std::size_t{1} << 20U}) { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+			auto cache_states{generate_states(size, &random)};
+			std::unique_ptr<DynamicCache> cache;
+
+			runner.run((boost::format("cache/dynamic-set-%d") % size).str(), size, [&cache, &cache_states]() {
+				for (std::size_t i{0}; i < cache_states.size(); i++) {
+					cache->set(cache_states[i], static_cast<int>(i % RNG_SIZE), Milliframes{static_cast<int64_t>(i)});
+				}
+
+				return uint64_t{cache->get_size()};
+			}, [&cache]() { cache = std::make_unique<DynamicCache>(0); });
+
+			runner.run((boost::format("cache/dynamic-get-%d") % size).str(), size, [&cache, &cache_states]() {
+				uint64_t checksum{0};
+
+				for (const auto & state : cache_states) {
+					checksum += static_cast<uint64_t>(cache->get(state).second.count());
+				}
+
+				return checksum;
+			});
+		}
+
+		{
+			auto directory{std::filesystem::temp_directory_path() / (boost::format("rosa-bench-%d") % random()).str()};
+			auto filename{(directory / "cache.mdb").string()};
+			std::vector<uint64_t> fingerprints(ROUTE_SIZE + 1);
+			std::iota(fingerprints.begin(), fingerprints.end(), 1);
+
+			const std::size_t size{std::size_t{1} << 18U}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+			const std::size_t memory_budget{std::size_t{32} << 20U}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+			auto cache_states{generate_states(size, &random)};
+			std::unique_ptr<PersistentCache> cache;
+
+			runner.run("cache/persistent-set-262144", size, [&cache, &cache_states]() {
+				for (std::size_t i{0}; i < cache_states.size(); i++) {
+					cache->set(cache_states[i], static_cast<int>(i % RNG_SIZE), Milliframes{static_cast<int64_t>(i)});
+				}
+
+				// The writes are only complete once the cache is closed.
+				cache.reset();
+
+				return uint64_t{0};
+			}, [&cache, &directory, &filename, &fingerprints, memory_budget]() {
+				cache.reset();
+				std::filesystem::remove_all(directory);
+				std::filesystem::create_directories(directory);
+				cache = std::make_unique<PersistentCache>(filename, fingerprints, memory_budget);
+			});
+
+			runner.run("cache/persistent-get-262144", size, [&cache, &cache_states]() {
+				uint64_t checksum{0};
+
+				for (const auto & state : cache_states) {
+					checksum += static_cast<uint64_t>(cache->get(state).second.count());
+				}
+
+				return checksum;
+			}, [&cache, &filename, &fingerprints, memory_budget]() {
+				cache.reset();
+				cache = std::make_unique<PersistentCache>(filename, fingerprints, memory_budget);
+			});
+
+			cache.reset();
+			std::filesystem::remove_all(directory);
+		}
+
+		{
+			auto no64_rosa{load_parameters("no64-rosa", 0)};
+			auto search{std::find_if(no64_rosa.route.begin(), no64_rosa.route.end(), [](const auto & instruction) { return instruction.type == InstructionType::Search; })};
+
+			if (search == no64_rosa.route.end()) {
+				throw std::runtime_error{"The route no64-rosa has no SEARCH"};
+			}
+
+			const auto & automaton{*search->search};
+			std::vector<std::size_t> encounter_ids;
+
+			for (std::size_t i{0}; i < STATE_COUNT; i++) {
+				encounter_ids.push_back(random() % no64_rosa.encounters.get_size());
+			}
+
+			runner.run("search/advance", 1U << 24U, [&automaton, &encounter_ids]() { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+				uint64_t checksum{0};
+				uint64_t values{0};
+
+				for (std::size_t i{0}; i < (1U << 24U); i++) { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+					auto [next_values, complete] = automaton.advance(values, encounter_ids[i % STATE_COUNT]);
+					values = complete ? 0 : next_values;
+					checksum += values;
+				}
+
+				return checksum;
+			});
+		}
+
+		for (const auto & steps : maximum_steps) {
+			auto parameters{load_parameters("paladin", steps)};
+
+			runner.run((boost::format("optimize/paladin-m%d") % steps).str(), 1, [&parameters]() {
+				Engine engine{parameters};
+				return uint64_t{engine.optimize(0).size()};
+			});
+		}
+
+		runner.write(output_filename);
+	} catch (const std::exception & e) {
+		std::cerr << "ERROR: " << e.what() << '\n';
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
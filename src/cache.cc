@@ -4,32 +4,522 @@
 
 #include <boost/format.hpp>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <csignal>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
+#include <stdexcept>
+
+const std::size_t WRITE_BATCH_SIZE = 65536;
+const std::size_t MAX_QUEUED_BATCHES = 4;
+
+const unsigned int MAXIMUM_DATABASES = 3;
+const char * const METADATA_DATABASE = "metadata";
+const char * const ENTRIES_DATABASE = "entries";
+const char * const PARTIES_DATABASE = "parties";
+const std::string_view VERSION_KEY{"version"};
+const std::string_view ROUTE_KEY{"route"};
+const std::string_view CACHE_VERSION{"2"};
+
+const unsigned int VARINT_BITS = 7;
+const unsigned int VARINT_MASK = 0x7F;
+const unsigned int VARINT_CONTINUE = 0x80;
+const unsigned int BYTE_BITS = 8;
+const unsigned int BYTE_MASK = 0xFF;
+
+const unsigned int INDEX_SHIFT = 48;
+const std::size_t INDEX_BYTES = 2;
+
+static void put_big_endian(char ** output, uint64_t value, std::size_t bytes) {
+	for (auto i{bytes}; i > 0; i--) {
+		*(*output)++ = static_cast<char>((value >> ((i - 1) * BYTE_BITS)) & BYTE_MASK); // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+	}
+}
+
+static auto get_big_endian(const char ** input, std::size_t bytes) -> uint64_t {
+	uint64_t value{0};
+
+	for (std::size_t i{0}; i < bytes; i++) {
+		value = (value << BYTE_BITS) | static_cast<unsigned char>(*(*input)++); // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+	}
+
+	return value;
+}
+
+// Writes seven bits per byte, least significant first, with the high bit set
+// on every byte but the last.
+static void put_varint(char ** output, uint64_t value) {
+	while (value > VARINT_MASK) {
+		*(*output)++ = static_cast<char>((value & VARINT_MASK) | VARINT_CONTINUE); // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+		value >>= VARINT_BITS;
+	}
+
+	*(*output)++ = static_cast<char>(value); // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+}
+
+static auto get_varint(const char ** input) -> uint64_t {
+	uint64_t value{0};
+	unsigned int shift{0};
 
-const std::size_t MAX_QUEUE_SIZE = 1024;
+	while (true) {
+		auto byte{static_cast<unsigned char>(*(*input)++)}; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+		value |= static_cast<uint64_t>(byte & VARINT_MASK) << shift;
+
+		if ((byte & VARINT_CONTINUE) == 0) {
+			return value;
+		}
+
+		shift += VARINT_BITS;
+	}
+}
+
+static auto database_exists(lmdb::txn * txn, const char * name) -> bool {
+	try {
+		lmdb::dbi::open(*txn, name);
+		return true;
+	} catch (const lmdb::not_found_error &) {
+		return false;
+	}
+}
+
+// Compares the route fingerprints stored with a cache to the current ones.
+// Since each fingerprint covers the rest of the route, the part that has not
+// changed is a common suffix. Returns the first stored index within it, and
+// the offset from there to the same instruction in the current route.
+static auto compare_routes(const std::vector<uint64_t> & stored, const std::vector<uint64_t> & current) -> std::pair<std::size_t, std::ptrdiff_t> {
+	std::size_t unchanged{0};
+
+	while (unchanged < stored.size() && unchanged < current.size() && stored[stored.size() - 1 - unchanged] == current[current.size() - 1 - unchanged]) {
+		unchanged++;
+	}
+
+	return std::make_pair(stored.size() - unchanged, static_cast<std::ptrdiff_t>(current.size()) - static_cast<std::ptrdiff_t>(stored.size()));
+}
+
+static void report_route_change(std::size_t first_index, std::size_t stored_size, std::ptrdiff_t offset) {
+	if (first_index >= stored_size) {
+		std::cerr << "The route or parameters have changed, so every cached entry will be discarded...\n";
+	} else {
+		std::cerr << "The route has changed, so only cached entries from index " << static_cast<std::ptrdiff_t>(first_index) + offset << " onward will be kept...\n";
+	}
+}
 
 Cache::~Cache() = default;
 
-auto DynamicCache::get(const State & state) -> std::pair<int, Milliframes> {
-	auto keys{state.get_keys()};
+void Cache::prepare(uint64_t /*signature*/) {}
 
-	if (_cache.count(keys) == 0) {
+void Cache::poll() {}
+
+// Set by the SIGTERM handler installed for snapshots, and checked whenever the
+// snapshot is polled.
+static volatile std::sig_atomic_t termination_requested{0}; // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static void request_termination(int /*signal*/) {
+	termination_requested = 1;
+}
+
+OverflowStore::OverflowStore(const std::string & location) : _location{location}, _env{lmdb::env::create()} {
+	std::filesystem::create_directories(_location);
+
+	_env.set_mapsize(128UL * 1024UL * 1024UL * 1024UL); // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+	_env.open(_location.c_str(), MDB_NOSYNC | MDB_WRITEMAP | MDB_NOTLS, 0664); // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+	_txn = lmdb::txn::begin(_env);
+	_dbi = lmdb::dbi::open(_txn, nullptr);
+}
+
+OverflowStore::~OverflowStore() {
+	_txn.abort();
+	_env.close();
+
+	std::error_code error;
+	std::filesystem::remove_all(_location, error);
+}
+
+auto OverflowStore::get(const CacheKey & key) -> std::pair<int, Milliframes> {
+	if (!_may_contain(hash_cache_key(key.first, key.second))) {
+		return std::make_pair(-1, Milliframes::max());
+	}
+
+	auto encoded_key{_encode_key(key)};
+	std::string_view value;
+
+	if (!_dbi.get(_txn, std::string_view{encoded_key.data(), encoded_key.size()}, value) || value.size() != VALUE_SIZE) {
 		return std::make_pair(-1, Milliframes::max());
 	}
 
-	return _cache.at(keys);
+	const auto * input{value.data()};
+	auto decision{static_cast<int>(get_big_endian(&input, 2))};
+	auto frames{get_big_endian(&input, 4)}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+	_dbi.del(_txn, std::string_view{encoded_key.data(), encoded_key.size()});
+	_count_write();
+
+	return std::make_pair(decision, frames == UINT32_MAX ? Milliframes::max() : Milliframes{frames});
+}
+
+void OverflowStore::set(const CacheKey & key, int value, Milliframes frames) {
+	auto encoded_key{_encode_key(key)};
+	std::array<char, VALUE_SIZE> encoded_value{};
+	auto * output{encoded_value.data()};
+
+	put_big_endian(&output, static_cast<uint64_t>(value), 2);
+	put_big_endian(&output, frames.count() >= UINT32_MAX ? UINT32_MAX : static_cast<uint64_t>(frames.count()), 4); // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+	_dbi.put(_txn, std::string_view{encoded_key.data(), encoded_key.size()}, std::string_view{encoded_value.data(), encoded_value.size()});
+	_add_to_filter(hash_cache_key(key.first, key.second));
+	_count_write();
+}
+
+void OverflowStore::_count_write() {
+	if (++_writes % OVERFLOW_COMMIT_SIZE == 0) {
+		_txn.commit();
+		_txn = lmdb::txn::begin(_env);
+	}
+}
+
+auto OverflowStore::_encode_key(const CacheKey & key) -> std::array<char, KEY_SIZE> {
+	std::array<char, KEY_SIZE> encoded_key{};
+	auto * output{encoded_key.data()};
+
+	put_big_endian(&output, key.second, sizeof(key.second));
+	put_big_endian(&output, key.first, sizeof(key.first));
+
+	return encoded_key;
+}
+
+// The lower half of the hash picks the word, and the upper half the bits set
+// within it.
+auto OverflowStore::_get_filter_bits(uint64_t hash) -> uint64_t {
+	const unsigned int shift{32};
+	const unsigned int bit_shift{6};
+	const uint64_t bit_mask{63};
+
+	uint64_t bits{0};
+
+	for (unsigned int i{0}; i < 4; i++) { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+		bits |= 1ULL << ((hash >> (shift + i * bit_shift)) & bit_mask);
+	}
+
+	return bits;
+}
+
+auto OverflowStore::_may_contain(uint64_t hash) const -> bool {
+	auto bits{_get_filter_bits(hash)};
+
+	return std::any_of(_filters.begin(), _filters.end(), [hash, bits](const auto & filter) {
+		return (filter.words[hash & (filter.words.size() - 1)] & bits) == bits;
+	});
+}
+
+void OverflowStore::_add_to_filter(uint64_t hash) {
+	if (_filters.empty() || _filters.back().size == _filters.back().capacity) {
+		auto capacity{_filters.empty() ? INITIAL_FILTER_CAPACITY : _filters.back().capacity * 2};
+		std::size_t words{1};
+
+		while (words * 64 < capacity * FILTER_BITS_PER_KEY) { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+			words *= 2;
+		}
+
+		_filters.push_back(Filter{std::vector<uint64_t>(words, 0), capacity, 0});
+	}
+
+	auto & filter{_filters.back()};
+
+	filter.words[hash & (filter.words.size() - 1)] |= _get_filter_bits(hash);
+	filter.size++;
+}
+
+// Recently evicted keys are kept with two bits per key within a single word.
+// The upper half of the hash picks the word, and the lower half the bits.
+static auto get_evicted_word(const std::vector<uint64_t> & filter, uint64_t hash) -> std::size_t {
+	const unsigned int shift{32};
+	return static_cast<std::size_t>(((hash >> shift) * filter.size()) >> shift);
+}
+
+static auto get_evicted_bits(uint64_t hash) -> uint64_t {
+	const unsigned int bit_shift{6};
+	const uint64_t bit_mask{63};
+
+	return (1ULL << (hash & bit_mask)) | (1ULL << ((hash >> bit_shift) & bit_mask));
+}
+
+DynamicCache::DynamicCache(std::size_t memory_budget) : _cache{0, memory_budget} {}
+
+DynamicCache::DynamicCache(std::size_t memory_budget, const std::string & overflow_location, bool overflow_for_thrashing, const std::string & snapshot_filename, Seconds snapshot_interval) :
+		_cache{0, overflow_for_thrashing ? memory_budget - memory_budget / EVICTED_FILTER_SHARE : memory_budget}, _snapshot{!snapshot_filename.empty()}, _snapshot_filename{snapshot_filename}, _snapshot_interval{snapshot_interval}, _snapshot_time{std::chrono::steady_clock::now()} {
+	if (overflow_for_thrashing) {
+		_overflow_location = overflow_location;
+	} else if (!overflow_location.empty()) {
+		_overflow = std::make_unique<OverflowStore>(overflow_location);
+	}
+}
+
+DynamicCache::~DynamicCache() {
+	if (_snapshot_file.is_open()) {
+		_write_snapshot();
+	}
+}
+
+auto DynamicCache::get(const State & state) -> std::pair<int, Milliframes> {
+	auto keys{state.get_packed_keys()};
+	auto result{_cache.get(keys)};
+
+	if (result.first >= 0) {
+		_memory_tier.hits++;
+	} else {
+		_memory_tier.misses++;
+
+		if (_overflow) {
+			result = _overflow->get(keys);
+
+			if (result.first >= 0) {
+				_overflow_tier.hits++;
+				_store(keys, result.first, result.second);
+			} else {
+				_overflow_tier.misses++;
+			}
+		}
+	}
+
+	if (_snapshot) {
+		_poll_snapshot();
+	}
+
+	return result;
 }
 
 void DynamicCache::set(const State & state, int value, Milliframes frames) {
-	_cache[state.get_keys()] = std::make_pair(value, frames);
+	auto keys{state.get_packed_keys()};
+	_store(keys, value, frames);
+
+	if (_snapshot) {
+		_snapshot_entries.push_back(SnapshotEntry{keys.first, keys.second, frames.count() >= UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(frames.count()), static_cast<uint16_t>(value), 0});
+		_poll_snapshot();
+	}
 }
 
 auto DynamicCache::get_size() const -> std::size_t {
-	return _cache.size();
+	return _cache.get_size();
+}
+
+auto DynamicCache::get_tiers() const -> std::vector<CacheTier> {
+	if (_overflow) {
+		return std::vector<CacheTier>{_memory_tier, _overflow_tier};
+	}
+
+	return std::vector<CacheTier>{_memory_tier};
+}
+
+// Loads the snapshot before the first solve, once the variable constraints
+// that are part of its signature are known.
+void DynamicCache::prepare(uint64_t signature) {
+	if (_snapshot && !_snapshot_file.is_open()) {
+		_load_snapshot(signature);
+		std::signal(SIGTERM, request_termination);
+	}
 }
 
-PersistentCache::PersistentCache(const std::string & filename, std::size_t cache_size) : _cache_size{cache_size}, _env{lmdb::env::create()} {
+// Writes the snapshot if it is due. After SIGTERM, the snapshot is written and
+// the signal is raised again with its default action, which ends the process.
+void DynamicCache::poll() {
+	if (!_snapshot_file.is_open()) {
+		return;
+	}
+
+	if (termination_requested != 0) {
+		_write_snapshot();
+		std::cerr << "Wrote snapshot to " << _snapshot_filename << " before exiting\n";
+
+		_overflow.reset();
+		std::signal(SIGTERM, SIG_DFL);
+		std::raise(SIGTERM);
+	}
+
+	if (_snapshot_entries.size() >= SNAPSHOT_BLOCK_SIZE || std::chrono::steady_clock::now() - _snapshot_time >= _snapshot_interval) {
+		_write_snapshot();
+	}
+}
+
+// Sets the entry in memory, moving any entry evicted for it to the overflow
+// store.
+void DynamicCache::_store(const CacheKey & key, int value, Milliframes frames) {
+	auto evicted{_cache.set(key, value, frames)};
+
+	if (evicted) {
+		const auto & [evicted_key, evicted_value, evicted_frames] = *evicted;
+
+		if (_overflow) {
+			_overflow->set(evicted_key, evicted_value, evicted_frames);
+		} else if (!_overflow_location.empty()) {
+			_check_thrashing(key, evicted_key);
+		}
+	}
+}
+
+// Once the table is full, every new entry evicts another, so a window of as
+// many evictions as the table holds sees it turn over once. If at least half of
+// the entries stored in a window were evicted in that window or the one before,
+// the search is mostly recomputing what it evicted, and the overflow store is
+// created to hold evicted entries from then on.
+void DynamicCache::_check_thrashing(const CacheKey & key, const CacheKey & evicted_key) {
+	if (_eviction_window == 0) {
+		_eviction_window = _cache.get_maximum_size();
+
+		for (auto & filter : _evicted_filters) {
+			filter.assign(std::max<std::size_t>(1, _eviction_window / EVICTED_KEYS_PER_WORD), 0);
+		}
+	}
+
+	auto hash{hash_cache_key(key.first, key.second)};
+	auto bits{get_evicted_bits(hash)};
+
+	if (std::any_of(_evicted_filters.begin(), _evicted_filters.end(), [hash, bits](const auto & filter) { return (filter[get_evicted_word(filter, hash)] & bits) == bits; })) {
+		_recomputations++;
+	}
+
+	auto evicted_hash{hash_cache_key(evicted_key.first, evicted_key.second)};
+	_evicted_filters[0][get_evicted_word(_evicted_filters[0], evicted_hash)] |= get_evicted_bits(evicted_hash);
+
+	if (++_evictions < _eviction_window) {
+		return;
+	}
+
+	if (_recomputations * 2 >= _evictions) {
+		std::cerr << "WARNING: The cache size is too small for this search, so evicted entries will be moved to " << _overflow_location << " rather than recomputed\n";
+
+		_overflow = std::make_unique<OverflowStore>(_overflow_location);
+		_evicted_filters = decltype(_evicted_filters){};
+
+		return;
+	}
+
+	std::swap(_evicted_filters[0], _evicted_filters[1]);
+	std::fill(_evicted_filters[0].begin(), _evicted_filters[0].end(), 0);
+
+	_evictions = 0;
+	_recomputations = 0;
+}
+
+auto DynamicCache::_get_checksum(const std::vector<SnapshotEntry> & entries) -> uint64_t {
+	uint64_t checksum{0};
+
+	for (const auto & entry : entries) {
+		auto packed_value{(static_cast<uint64_t>(entry.value) << 32U) | entry.frames}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+		checksum = hash_cache_key(hash_cache_key(checksum, entry.key1), hash_cache_key(entry.key2, packed_value));
+	}
+
+	return checksum;
+}
+
+// Loads the entries of every complete block of an existing snapshot, and cuts
+// off anything after them so that new blocks follow directly. A snapshot with a
+// different signature is replaced.
+void DynamicCache::_load_snapshot(uint64_t signature) {
+	const std::array<char, 8> magic{'R', 'O', 'S', 'A', 'S', 'N', 'A', 'P'}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+	const SnapshotHeader header{magic, SNAPSHOT_VERSION, sizeof(SnapshotEntry), signature};
+
+	std::size_t length{0};
+
+	if (std::filesystem::exists(_snapshot_filename)) {
+		std::ifstream input{_snapshot_filename, std::ios_base::in | std::ios_base::binary};
+		SnapshotHeader stored{};
+
+		input.read(reinterpret_cast<char *>(&stored), sizeof(stored)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+
+		if (!input || stored.magic != magic || stored.version != SNAPSHOT_VERSION || stored.entry_size != sizeof(SnapshotEntry)) {
+			throw std::runtime_error{"Invalid snapshot file " + _snapshot_filename};
+		}
+
+		if (stored.signature != signature) {
+			std::cerr << "WARNING: The snapshot at " << _snapshot_filename << " was written for a different route, parameters or variable constraints and will be replaced\n";
+		} else {
+			std::cerr << "Resuming from existing snapshot...\n";
+			length = sizeof(stored);
+
+			SnapshotBlock block{};
+			std::vector<SnapshotEntry> entries;
+			std::size_t count{0};
+
+			while (input.read(reinterpret_cast<char *>(&block), sizeof(block))) { // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+				entries.resize(std::min<std::size_t>(block.size, SNAPSHOT_BLOCK_SIZE));
+				input.read(reinterpret_cast<char *>(entries.data()), static_cast<std::streamsize>(entries.size() * sizeof(SnapshotEntry))); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+
+				if (!input || entries.size() != block.size || _get_checksum(entries) != block.checksum) {
+					std::cerr << "WARNING: Discarding an incomplete block at the end of the snapshot\n";
+					break;
+				}
+
+				for (const auto & entry : entries) {
+					_store(CacheKey{entry.key1, entry.key2}, entry.value, entry.frames == UINT32_MAX ? Milliframes::max() : Milliframes{entry.frames});
+				}
+
+				length += sizeof(block) + block.size * sizeof(SnapshotEntry);
+				count += block.size;
+			}
+
+			std::cerr << "Loaded " << count << " snapshot entries\n";
+		}
+	} else {
+		auto directory{std::filesystem::path{_snapshot_filename}.parent_path()};
+
+		if (!directory.empty()) {
+			std::filesystem::create_directories(directory);
+		}
+	}
+
+	if (length > 0) {
+		std::filesystem::resize_file(_snapshot_filename, length);
+		_snapshot_file.open(_snapshot_filename, std::ios_base::out | std::ios_base::app | std::ios_base::binary);
+	} else {
+		_snapshot_file.open(_snapshot_filename, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+		_snapshot_file.write(reinterpret_cast<const char *>(&header), sizeof(header)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+		_snapshot_file.flush();
+	}
+
+	if (!_snapshot_file) {
+		throw std::runtime_error{"Failed to open snapshot file " + _snapshot_filename};
+	}
+}
+
+// Polls the snapshot on every so many lookups, so that the time is not checked
+// on each one.
+void DynamicCache::_poll_snapshot() {
+	if (++_snapshot_polls % SNAPSHOT_POLL_INTERVAL != 0 && _snapshot_entries.size() < SNAPSHOT_BLOCK_SIZE) {
+		return;
+	}
+
+	poll();
+}
+
+// Appends the entries set since the last snapshot as one block.
+void DynamicCache::_write_snapshot() {
+	_snapshot_time = std::chrono::steady_clock::now();
+
+	if (_snapshot_entries.empty()) {
+		return;
+	}
+
+	const SnapshotBlock block{_snapshot_entries.size(), _get_checksum(_snapshot_entries)};
+	auto size{static_cast<std::streamsize>(_snapshot_entries.size() * sizeof(SnapshotEntry))};
+
+	_snapshot_file.write(reinterpret_cast<const char *>(&block), sizeof(block)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+	_snapshot_file.write(reinterpret_cast<const char *>(_snapshot_entries.data()), size); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+	_snapshot_file.flush();
+
+	if (!_snapshot_file) {
+		std::cerr << "ERROR: Failed to write snapshot to " << _snapshot_filename << '\n';
+	}
+
+	_snapshot_entries.clear();
+}
+
+PersistentCache::PersistentCache(const std::string & filename, const std::vector<uint64_t> & route, std::size_t memory_budget) : _cache{0, memory_budget}, _env{lmdb::env::create()} {
 	if (std::filesystem::exists(filename)) {
 		std::cerr << "Using existing cache database...\n";
 	} else {
@@ -37,104 +527,624 @@ PersistentCache::PersistentCache(const std::string & filename, std::size_t cache
 		std::filesystem::create_directories(filename);
 	}
 
-	_env.set_mapsize(128UL * 1024UL * 1024UL * 1024UL); // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-	_env.open(filename.c_str(), MDB_NOSYNC | MDB_WRITEMAP | MDB_NOLOCK, 0664); // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+	_open_environment(&_env, filename);
 
 	auto txn{lmdb::txn::begin(_env)};
-	_dbi = lmdb::dbi::open(txn, nullptr);
+	auto main_dbi{lmdb::dbi::open(txn, nullptr)};
 
-	txn.abort();
+	if (main_dbi.size(txn) > 0 && !database_exists(&txn, METADATA_DATABASE)) {
+		throw std::runtime_error{"The cache database at " + filename + " uses an old format and must be converted"};
+	}
+
+	auto metadata_dbi{lmdb::dbi::open(txn, METADATA_DATABASE, MDB_CREATE)};
+	std::string_view version;
+
+	if (!metadata_dbi.get(txn, VERSION_KEY, version)) {
+		metadata_dbi.put(txn, VERSION_KEY, CACHE_VERSION);
+	} else if (version != CACHE_VERSION) {
+		throw std::runtime_error{"The cache database at " + filename + " uses an unknown format"};
+	}
+
+	_entries_dbi = lmdb::dbi::open(txn, ENTRIES_DATABASE, MDB_CREATE);
+	_parties_dbi = lmdb::dbi::open(txn, PARTIES_DATABASE, MDB_CREATE);
+
+	auto cursor{lmdb::cursor::open(txn, _parties_dbi)};
+	std::string_view key;
+	std::string_view value;
+
+	while (cursor.get(key, value, MDB_NEXT)) {
+		const auto * data{key.data()};
+		auto key1{get_big_endian(&data, 2)};
+		auto key2{get_big_endian(&data, sizeof(uint64_t))};
+
+		data = value.data();
+		_parties.emplace(std::make_pair(key1, key2), static_cast<uint32_t>(get_varint(&data)));
+	}
+
+	cursor.close();
+
+	_update_route(&txn, &metadata_dbi, route);
+	txn.commit();
+
+	_read_txn = lmdb::txn::begin(_env, nullptr, MDB_RDONLY);
+	_batch.reserve(WRITE_BATCH_SIZE);
+	_writer = std::thread{&PersistentCache::_write, this};
 }
 
 PersistentCache::~PersistentCache() {
-	_flush_write_queue();
+	_queue_batch();
+
+	{
+		std::lock_guard<std::mutex> lock{_mutex};
+		_stopping = true;
+	}
+
+	_queue_changed.notify_all();
+	_writer.join();
+
+	_read_txn.abort();
 }
 
 auto PersistentCache::get(const State & state) -> std::pair<int, Milliframes> {
+	auto packed_keys{state.get_packed_keys()};
+	auto result{_cache.get(packed_keys)};
+
+	if (result.first >= 0) {
+		_memory_tier.hits++;
+		return result;
+	}
+
+	_memory_tier.misses++;
+
 	auto keys{state.get_keys()};
+	auto party{_find_party(keys, false)};
+
+	if (!party) {
+		_database_tier.misses++;
+		return result;
+	}
+
+	auto commits{_commits.load()};
 
-	if (_cache.count(keys) > 0) {
-		return _cache.at(keys);
+	if (commits != _read_commits) {
+		_read_txn.reset();
+		_read_txn.renew();
+		_read_commits = commits;
 	}
 
-	auto txn{lmdb::txn::begin(_env, nullptr, MDB_RDONLY)};
-	auto result{std::make_pair(-1, Milliframes::max())};
+	std::array<char, KEY_SIZE> key{};
+	auto key_length{_encode_key(keys, *party, &key)};
 
-	auto key{_encode_key(keys)};
 	std::string_view value;
 
-	if (_dbi.get(txn, key, value)) {
+	if (_entries_dbi.get(_read_txn, std::string_view{key.data(), key_length}, value)) {
 		result = _decode_value(value);
+		_cache.set(packed_keys, result.first, result.second);
+		_database_tier.hits++;
+	} else {
+		_database_tier.misses++;
 	}
 
-	txn.abort();
-
 	return result;
 }
 
 void PersistentCache::set(const State & state, int value, Milliframes frames) {
-	auto keys{state.get_keys()};
+	_cache.set(state.get_packed_keys(), value, frames);
+	_store(state.get_keys(), value, frames);
+}
+
+auto PersistentCache::get_size() const -> std::size_t {
+	return _cache.get_size();
+}
 
-	_cache[keys] = std::make_pair(value, frames);
+auto PersistentCache::get_tiers() const -> std::vector<CacheTier> {
+	return std::vector<CacheTier>{_memory_tier, _database_tier};
+}
 
-	if (_cache.size() > _cache_size) {
-		_cache.clear();
+// Returns whether a database exists and was written in the original format,
+// in which keys and values were stored as raw native-endian 64-bit integers.
+auto PersistentCache::needs_conversion(const std::string & filename) -> bool {
+	if (!std::filesystem::exists(filename)) {
+		return false;
 	}
 
-	auto key{_encode_key(keys)};
-	auto encoded_value{_encode_value(value, frames)};
+	lmdb::env env{lmdb::env::create()};
+	_open_environment(&env, filename);
+
+	auto txn{lmdb::txn::begin(env, nullptr, MDB_RDONLY)};
+	auto main_dbi{lmdb::dbi::open(txn, nullptr)};
+	auto result{main_dbi.size(txn) > 0 && !database_exists(&txn, METADATA_DATABASE)};
+
+	txn.abort();
+
+	return result;
+}
+
+// Rewrites a database in the original format into the current one. The new
+// database is built alongside the old one, which it only replaces once every
+// entry has been copied. Returns the number of entries converted.
+auto PersistentCache::convert(const std::string & filename) -> std::size_t {
+	std::string converted_filename{filename + ".converting"};
+	std::size_t count{0};
+
+	std::filesystem::remove_all(converted_filename);
+
+	{
+		lmdb::env env{lmdb::env::create()};
+		_open_environment(&env, filename);
+
+		PersistentCache cache{converted_filename, {}, 0};
+
+		auto txn{lmdb::txn::begin(env, nullptr, MDB_RDONLY)};
+		auto dbi{lmdb::dbi::open(txn, nullptr)};
+		auto cursor{lmdb::cursor::open(txn, dbi)};
+
+		std::string_view key;
+		std::string_view value;
+
+		while (cursor.get(key, value, MDB_NEXT)) {
+			std::array<uint64_t, 3> keys{};
+			std::array<int64_t, 2> values{};
+
+			if (key.size() != sizeof(keys) || value.size() != sizeof(values)) {
+				std::cerr << "WARNING: Skipping malformed cache entry\n";
+				continue;
+			}
 
-	_write_queue.emplace(key, encoded_value);
+			std::memcpy(keys.data(), key.data(), sizeof(keys));
+			std::memcpy(values.data(), value.data(), sizeof(values));
 
-	if (_write_queue.size() > MAX_QUEUE_SIZE) {
-		_flush_write_queue();
+			cache._store(std::make_tuple(keys[0], keys[1], keys[2]), static_cast<int>(values[0]), Milliframes{values[1]});
+			count++;
+		}
+
+		cursor.close();
+		txn.abort();
 	}
+
+	std::filesystem::remove_all(filename);
+	std::filesystem::rename(converted_filename, filename);
+
+	return count;
 }
 
-auto PersistentCache::get_size() const -> std::size_t {
-	return _cache.size();
+void PersistentCache::_open_environment(lmdb::env * env, const std::string & filename) {
+	env->set_mapsize(128UL * 1024UL * 1024UL * 1024UL); // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+	env->set_max_dbs(MAXIMUM_DATABASES);
+	env->open(filename.c_str(), MDB_NOSYNC | MDB_WRITEMAP | MDB_NOTLS, 0664); // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
 }
 
-auto PersistentCache::_encode_key(std::tuple<uint64_t, uint64_t, uint64_t> keys) -> std::string {
-	auto & [key1, key2, key3] = keys;
-	std::string result{sizeof(key1) + sizeof(key2) + sizeof(key3), 0, std::string::allocator_type{}};
+// Returns every entry for a route index. As the index starts the key, these are
+// adjacent in the database.
+auto PersistentCache::_read_index(lmdb::txn * txn, lmdb::dbi * dbi, std::size_t index) -> std::vector<std::pair<std::string, std::string>> {
+	std::array<char, INDEX_BYTES> prefix{};
+	auto * output{prefix.data()};
+	put_big_endian(&output, index, INDEX_BYTES);
 
-	std::copy_n(reinterpret_cast<char*>(&key1), sizeof(key1), result.begin()); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
-	std::copy_n(reinterpret_cast<char*>(&key2), sizeof(key2), result.begin() + sizeof(key1)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
-	std::copy_n(reinterpret_cast<char*>(&key3), sizeof(key3), result.begin() + sizeof(key1) + sizeof(key2)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+	std::vector<std::pair<std::string, std::string>> entries;
 
-	return result;
+	auto cursor{lmdb::cursor::open(*txn, *dbi)};
+	std::string_view key{prefix.data(), prefix.size()};
+	std::string_view value;
+
+	for (auto operation{MDB_SET_RANGE}; cursor.get(key, value, operation) && key.substr(0, INDEX_BYTES) == std::string_view{prefix.data(), prefix.size()}; operation = MDB_NEXT) {
+		entries.emplace_back(key, value);
+	}
+
+	cursor.close();
+
+	return entries;
 }
 
-auto PersistentCache::_encode_value(int value, Milliframes frames) -> std::string {
-	int64_t value1{static_cast<int64_t>(value)};
-	int64_t value2{static_cast<int64_t>(frames.count())};
+// Brings the entries in line with the current route, and records its
+// fingerprints. If the database has no fingerprints, it was written before
+// they were stored, and its entries are assumed to be for the current route.
+// Entries for each index are moved in the order that keeps them from landing
+// on ones that have not yet been moved.
+void PersistentCache::_update_route(lmdb::txn * txn, lmdb::dbi * metadata_dbi, const std::vector<uint64_t> & route) {
+	if (route.empty()) {
+		return;
+	}
 
-	std::string result{sizeof(int64_t) * 2, 0, std::string::allocator_type{}};
+	std::string_view data;
 
-	std::copy(reinterpret_cast<char*>(&value1), reinterpret_cast<char*>(&value1) + sizeof(value1), result.begin()); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast, cppcoreguidelines-pro-bounds-pointer-arithmetic)
-	std::copy(reinterpret_cast<char*>(&value2), reinterpret_cast<char*>(&value2) + sizeof(value2), result.begin() + sizeof(value1)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast, cppcoreguidelines-pro-bounds-pointer-arithmetic)
+	if (metadata_dbi->get(*txn, ROUTE_KEY, data)) {
+		std::vector<uint64_t> stored;
+		const auto * input{data.data()};
 
-	return result;
+		for (std::size_t i{0}; i < data.size() / sizeof(uint64_t); i++) {
+			stored.push_back(get_big_endian(&input, sizeof(uint64_t)));
+		}
+
+		if (stored == route) {
+			return;
+		}
+
+		const auto [first_index, offset] = compare_routes(stored, route);
+		report_route_change(first_index, stored.size(), offset);
+
+		std::size_t discarded{0};
+
+		for (std::size_t index{0}; index < std::min(first_index, stored.size()); index++) {
+			for (const auto & entry : _read_index(txn, &_entries_dbi, index)) {
+				_entries_dbi.del(*txn, entry.first);
+				discarded++;
+			}
+		}
+
+		if (offset != 0) {
+			for (std::size_t i{first_index}; i < stored.size(); i++) {
+				auto index{offset > 0 ? stored.size() - 1 - (i - first_index) : i};
+
+				for (auto & [key, value] : _read_index(txn, &_entries_dbi, index)) {
+					_entries_dbi.del(*txn, key);
+
+					auto * output{key.data()};
+					put_big_endian(&output, static_cast<uint64_t>(static_cast<std::ptrdiff_t>(index) + offset), INDEX_BYTES);
+
+					_entries_dbi.put(*txn, key, value);
+				}
+			}
+		}
+
+		std::cerr << "Discarded " << discarded << " cached entries\n";
+	} else if (_entries_dbi.size(*txn) > 0) {
+		std::cerr << "WARNING: The cache database does not record the route it was written for, so its entries are assumed to match the current route\n";
+	}
+
+	std::string encoded(route.size() * sizeof(uint64_t), '\0');
+	auto * output{encoded.data()};
+
+	for (const auto & fingerprint : route) {
+		put_big_endian(&output, fingerprint, sizeof(uint64_t));
+	}
+
+	metadata_dbi->put(*txn, ROUTE_KEY, encoded);
+}
+
+// The route index comes first so that entries are ordered by it. The party ID
+// replaces both words of the party key. The remaining segment count is offset
+// by one so that the common value of -1 (no limit) is stored as a single zero
+// byte, as are search values outside of a search.
+auto PersistentCache::_encode_key(const std::tuple<uint64_t, uint64_t, uint64_t> & keys, uint32_t party, std::array<char, KEY_SIZE> * data) -> std::size_t {
+	auto key1{std::get<0>(keys)};
+	auto key2{std::get<1>(keys)};
+	auto * output{data->data()};
+
+	put_big_endian(&output, key2 >> INDEX_SHIFT, INDEX_BYTES);
+	put_varint(&output, party);
+	put_varint(&output, ((key1 >> 32U) + 1) & UINT16_MAX); // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+	put_big_endian(&output, key1 & UINT32_MAX, 4); // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+	put_varint(&output, key2 & ((1ULL << MAXIMUM_SEARCH_TERMS) - 1));
+
+	return static_cast<std::size_t>(output - data->data());
+}
+
+auto PersistentCache::_encode_value(int value, Milliframes frames, std::array<char, VALUE_SIZE> * data) -> std::size_t {
+	auto * output{data->data()};
+
+	put_varint(&output, static_cast<uint64_t>(value));
+	put_varint(&output, static_cast<uint64_t>(frames.count()));
+
+	return static_cast<std::size_t>(output - data->data());
 }
 
 auto PersistentCache::_decode_value(const std::string_view & data) -> std::pair<int, Milliframes> {
-	int64_t value1{0};
-	int64_t value2{0};
+	const auto * input{data.data()};
 
-	std::copy(data.begin(), data.begin() + sizeof(value1), reinterpret_cast<char*>(&value1)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
-	std::copy(data.begin() + sizeof(value1), data.begin() + sizeof(value1) + sizeof(value2), reinterpret_cast<char*>(&value2)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast, cppcoreguidelines-pro-bounds-pointer-arithmetic)
+	auto value{get_varint(&input)};
+	auto frames{get_varint(&input)};
 
-	return std::make_pair(static_cast<int>(value1), Milliframes{value2});
+	return std::make_pair(static_cast<int>(value), Milliframes{static_cast<int64_t>(frames)});
 }
 
-auto PersistentCache::_flush_write_queue() noexcept -> void {
-	auto txn{lmdb::txn::begin(_env)};
+// Returns the database's ID for the party in the keys, assigning a new one and
+// queuing it to be stored if requested.
+auto PersistentCache::_find_party(const std::tuple<uint64_t, uint64_t, uint64_t> & keys, bool add) -> std::optional<uint32_t> {
+	auto party{std::make_pair(std::get<0>(keys) >> 48U, std::get<2>(keys))}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+	auto iterator{_parties.find(party)};
 
-	for (const auto & [key, value] : _write_queue) {
-		_dbi.put(txn, key, value);
+	if (iterator != _parties.end()) {
+		return iterator->second;
 	}
 
-	txn.commit();
-	_write_queue.clear();
+	if (!add) {
+		return std::nullopt;
+	}
+
+	auto id{static_cast<uint32_t>(_parties.size())};
+	_parties.emplace(party, id);
+
+	auto & write{_batch.emplace_back()};
+	auto * output{write.key.data()};
+
+	put_big_endian(&output, party.first, 2);
+	put_big_endian(&output, party.second, sizeof(uint64_t));
+	write.key_length = static_cast<uint8_t>(output - write.key.data());
+
+	output = write.value.data();
+	put_varint(&output, id);
+	write.value_length = static_cast<uint8_t>(output - write.value.data());
+
+	write.party = true;
+
+	return id;
+}
+
+void PersistentCache::_store(const std::tuple<uint64_t, uint64_t, uint64_t> & keys, int value, Milliframes frames) {
+	auto party{*_find_party(keys, true)};
+	auto & write{_batch.emplace_back()};
+
+	write.key_length = static_cast<uint8_t>(_encode_key(keys, party, &write.key));
+	write.value_length = static_cast<uint8_t>(_encode_value(value, frames, &write.value));
+	write.party = false;
+
+	if (_batch.size() >= WRITE_BATCH_SIZE) {
+		_queue_batch();
+	}
+}
+
+// Hands the current batch to the writer thread. If the writer has fallen too
+// far behind, this waits for it, so that the queue cannot grow without bound.
+void PersistentCache::_queue_batch() {
+	if (_batch.empty()) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock{_mutex};
+	_queue_changed.wait(lock, [this]() { return _queue.size() < MAX_QUEUED_BATCHES; });
+	_queue.push_back(std::move(_batch));
+	lock.unlock();
+
+	_queue_changed.notify_all();
+
+	_batch = std::vector<Write>{};
+	_batch.reserve(WRITE_BATCH_SIZE);
+}
+
+// Runs on the writer thread. Each batch is sorted by database and key, which is
+// the order LMDB stores them in, and committed in a single transaction, so a new
+// party is always committed no later than the entries that use it. Later writes
+// to the same key replace earlier ones, as they would have if written directly.
+void PersistentCache::_write() {
+	while (true) {
+		std::vector<Write> batch;
+
+		{
+			std::unique_lock<std::mutex> lock{_mutex};
+			_queue_changed.wait(lock, [this]() { return _stopping || !_queue.empty(); });
+
+			if (_queue.empty()) {
+				break;
+			}
+
+			batch = std::move(_queue.front());
+			_queue.pop_front();
+		}
+
+		_queue_changed.notify_all();
+
+		std::stable_sort(batch.begin(), batch.end(), [](const auto & a, const auto & b) {
+			return std::make_pair(a.party, std::string_view{a.key.data(), a.key_length}) < std::make_pair(b.party, std::string_view{b.key.data(), b.key_length});
+		});
+
+		auto txn{lmdb::txn::begin(_env)};
+
+		for (const auto & write : batch) {
+			auto & dbi{write.party ? _parties_dbi : _entries_dbi};
+			dbi.put(txn, std::string_view{write.key.data(), write.key_length}, std::string_view{write.value.data(), write.value_length});
+		}
+
+		txn.commit();
+		_commits++;
+	}
+}
+
+MappedCache::MappedCache(const std::string & filename, const std::vector<uint64_t> & route) : _filename{filename} {
+	if (std::filesystem::exists(filename)) {
+		std::cerr << "Using existing cache file...\n";
+		_map(filename, 0, 0, false);
+
+		// The destructor does not run if the constructor throws.
+		try {
+			std::vector<uint64_t> stored(_route, _route + _header->route_size); // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+
+			if (stored != route) {
+				const auto [first_index, offset] = compare_routes(stored, route);
+				report_route_change(first_index, stored.size(), offset);
+
+				auto size{_header->size};
+				_rebuild(_header->capacity, route, first_index, offset);
+
+				std::cerr << "Discarded " << size - _header->size << " cached entries\n";
+			}
+		} catch (...) {
+			_unmap();
+			throw;
+		}
+	} else {
+		std::cerr << "Creating new cache file...\n";
+
+		auto directory{std::filesystem::path{filename}.parent_path()};
+
+		if (!directory.empty()) {
+			std::filesystem::create_directories(directory);
+		}
+
+		_map(filename, INITIAL_CAPACITY, route.size(), true);
+		std::copy(route.begin(), route.end(), _route);
+	}
+}
+
+MappedCache::~MappedCache() {
+	_unmap();
+}
+
+auto MappedCache::get(const State & state) -> std::pair<int, Milliframes> {
+	const auto * entry{_find(state.get_keys())};
+
+	if (entry->value == 0) {
+		_file_tier.misses++;
+		return std::make_pair(-1, Milliframes::max());
+	}
+
+	_file_tier.hits++;
+
+	return std::make_pair(static_cast<int>(entry->value) - 1, entry->frames == UINT32_MAX ? Milliframes::max() : Milliframes{entry->frames});
+}
+
+void MappedCache::set(const State & state, int value, Milliframes frames) {
+	auto keys{state.get_keys()};
+	auto * entry{_find(keys)};
+
+	if (entry->value == 0) {
+		if ((_header->size + 1) * 4 > _header->capacity * 3) { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+			_rebuild(_header->capacity * 2, std::vector<uint64_t>(_route, _route + _header->route_size), 0, 0); // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+			entry = _find(keys);
+		}
+
+		std::tie(entry->key1, entry->key2, entry->key3) = keys;
+		_header->size++;
+	}
+
+	entry->value = static_cast<uint16_t>(value + 1);
+	entry->frames = frames.count() >= UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(frames.count());
+}
+
+auto MappedCache::get_size() const -> std::size_t {
+	return _header->size;
+}
+
+auto MappedCache::get_tiers() const -> std::vector<CacheTier> {
+	return std::vector<CacheTier>{_file_tier};
+}
+
+auto MappedCache::_find(const std::tuple<uint64_t, uint64_t, uint64_t> & keys) const -> Entry * {
+	const auto & [key1, key2, key3] = keys;
+
+	auto mask{_header->capacity - 1};
+	auto position{hash_cache_key(hash_cache_key(key1, key2), key3) & mask};
+
+	while (_entries[position].value != 0 && (_entries[position].key1 != key1 || _entries[position].key2 != key2 || _entries[position].key3 != key3)) { // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+		position = (position + 1) & mask;
+	}
+
+	return &_entries[position]; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+}
+
+// Opens and maps the file, and only replaces the current mapping once it is
+// known to be valid. On failure, whatever was opened is released again, and the
+// current mapping is left as it was.
+void MappedCache::_map(const std::string & filename, std::size_t capacity, std::size_t route_size, bool create) {
+	auto fd{open(filename.c_str(), create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0664)}; // NOLINT(cppcoreguidelines-pro-type-vararg,hicpp-signed-bitwise,cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+	if (fd < 0) {
+		throw std::runtime_error{"Failed to open cache file " + filename};
+	}
+
+	void * data{nullptr};
+	std::size_t length{0};
+
+	auto fail{[&](const std::string & message) {
+		if (data != nullptr) {
+			munmap(data, length);
+		}
+
+		close(fd);
+
+		throw std::runtime_error{message + " " + filename};
+	}};
+
+	if (create) {
+		length = sizeof(Header) + capacity * sizeof(Entry) + route_size * sizeof(uint64_t);
+
+		if (ftruncate(fd, static_cast<off_t>(length)) != 0) {
+			fail("Failed to resize cache file");
+		}
+	} else {
+		std::error_code error;
+		length = std::filesystem::file_size(filename, error);
+
+		if (error || length < sizeof(Header)) {
+			fail("Invalid cache file");
+		}
+	}
+
+	data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0); // NOLINT(hicpp-signed-bitwise)
+
+	if (data == MAP_FAILED) { // NOLINT(cppcoreguidelines-pro-type-cstyle-cast)
+		data = nullptr;
+		fail("Failed to map cache file");
+	}
+
+	madvise(data, length, MADV_RANDOM);
+
+	auto * header{static_cast<Header *>(data)};
+
+	const std::array<char, 8> magic{'R', 'O', 'S', 'A', 'M', 'A', 'P', '\0'}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+	if (create) {
+		header->magic = magic;
+		header->version = VERSION;
+		header->entry_size = sizeof(Entry);
+		header->capacity = capacity;
+		header->size = 0;
+		header->route_size = route_size;
+	} else if (header->magic != magic || header->version != VERSION || header->entry_size != sizeof(Entry) || header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0 || length != sizeof(Header) + header->capacity * sizeof(Entry) + header->route_size * sizeof(uint64_t)) {
+		fail("Invalid cache file");
+	}
+
+	_fd = fd;
+	_data = data;
+	_length = length;
+	_header = header;
+	_entries = reinterpret_cast<Entry *>(static_cast<char *>(_data) + sizeof(Header)); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast,cppcoreguidelines-pro-bounds-pointer-arithmetic)
+	_route = reinterpret_cast<uint64_t *>(_entries + _header->capacity); // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast,cppcoreguidelines-pro-bounds-pointer-arithmetic)
+}
+
+void MappedCache::_unmap() {
+	if (_data != nullptr) {
+		munmap(_data, _length);
+		_data = nullptr;
+	}
+
+	if (_fd >= 0) {
+		close(_fd);
+		_fd = -1;
+	}
+}
+
+// Rebuilds the table at the given size in a temporary file, which replaces the
+// original once every entry has been copied. Until then, the original file is
+// left untouched. This grows the table, and also applies a route change, by
+// keeping only the entries from the first unchanged index onward and moving
+// them by the offset.
+void MappedCache::_rebuild(std::size_t capacity, const std::vector<uint64_t> & route, std::size_t first_index, std::ptrdiff_t offset) {
+	auto * data{_data};
+	auto length{_length};
+	auto fd{_fd};
+	const auto * entries{_entries};
+	auto old_capacity{_header->capacity};
+
+	std::string filename{_filename + ".tmp"};
+	_map(filename, capacity, route.size(), true);
+	std::copy(route.begin(), route.end(), _route);
+
+	const uint64_t index_mask{(1ULL << INDEX_SHIFT) - 1};
+
+	for (std::size_t i{0}; i < old_capacity; i++) {
+		auto entry{entries[i]}; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+		auto index{static_cast<std::size_t>(entry.key2 >> INDEX_SHIFT)};
+
+		if (entry.value != 0 && index >= first_index) {
+			entry.key2 = (entry.key2 & index_mask) | (static_cast<uint64_t>(static_cast<std::ptrdiff_t>(index) + offset) << INDEX_SHIFT);
+			*_find(std::make_tuple(entry.key1, entry.key2, entry.key3)) = entry;
+			_header->size++;
+		}
+	}
+
+	munmap(data, length);
+	close(fd);
+
+	std::filesystem::rename(filename, _filename);
 }
@@ -1,23 +1,41 @@
 #ifndef ROSA_CACHE_HH
 #define ROSA_CACHE_HH
 
+#include "cache_table.hh"
 #include "duration.hh"
 #include "state.hh"
 
 #include "lmdb++.h"
 
-#include <boost/functional/hash.hpp>
-#include <tsl/sparse_map.h>
-
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <vector>
 
 enum class CacheType {
 	Dynamic,
+	Mapped,
 	Persistent
 };
 
+// The lookups answered and missed by one tier of a cache.
+struct CacheTier {
+	std::string name;
+	std::size_t hits{0};
+	std::size_t misses{0};
+};
+
 class Cache {
 	public:
 		Cache() = default;
@@ -32,22 +50,191 @@ class Cache {
 		virtual void set(const State & state, int value, Milliframes frames) = 0;
 
 		[[nodiscard]] virtual auto get_size() const -> std::size_t = 0;
+
+		// Returns the lookups made in each tier of the cache, fastest first.
+		[[nodiscard]] virtual auto get_tiers() const -> std::vector<CacheTier> = 0;
+
+		// Called before each solve with a signature of the route, parameters
+		// and variable constraints that it is for.
+		virtual void prepare(uint64_t signature);
+
+		// Called between blocks of work that do not touch the cache, so that
+		// periodic work is not held up by them.
+		virtual void poll();
+};
+
+// Holds the entries evicted from an in-memory cache that has reached its memory
+// budget, in an LMDB database in a directory of its own that is removed again
+// when the store is destroyed. Nothing is synced to disk, since the store does
+// not outlive the run. All access goes through one write transaction, so that
+// lookups see entries that are not yet committed, and it is committed every
+// OVERFLOW_COMMIT_SIZE writes. Keys are the big-endian packed key, starting with
+// the route index. A lookup that finds an entry also removes it, since the
+// entry is moved back into memory, and is counted as a write.
+//
+// Most lookups are for states that were never moved to the store, so it keeps
+// a Bloom filter of its keys in memory, at about ten bits per key, and only
+// reads the database when the filter may contain the key. Each key sets four
+// bits in a single word, so a check touches one word per filter. Once a filter
+// is full, a new one twice its size is added.
+class OverflowStore {
+	public:
+		explicit OverflowStore(const std::string & location);
+		OverflowStore(const OverflowStore &) = delete;
+		OverflowStore(const OverflowStore &&) = delete;
+		auto operator=(const OverflowStore &) -> OverflowStore & = delete;
+		auto operator=(const OverflowStore &&) -> OverflowStore & = delete;
+
+		~OverflowStore();
+
+		auto get(const CacheKey & key) -> std::pair<int, Milliframes>;
+		void set(const CacheKey & key, int value, Milliframes frames);
+
+	private:
+		static constexpr std::size_t OVERFLOW_COMMIT_SIZE = 4096;
+		static constexpr std::size_t KEY_SIZE = 16;
+		static constexpr std::size_t VALUE_SIZE = 6;
+
+		static constexpr std::size_t INITIAL_FILTER_CAPACITY = 65536;
+		static constexpr std::size_t FILTER_BITS_PER_KEY = 10;
+
+		struct Filter {
+			std::vector<uint64_t> words;
+			std::size_t capacity;
+			std::size_t size;
+		};
+
+		static auto _encode_key(const CacheKey & key) -> std::array<char, KEY_SIZE>;
+		static auto _get_filter_bits(uint64_t hash) -> uint64_t;
+
+		[[nodiscard]] auto _may_contain(uint64_t hash) const -> bool;
+		void _add_to_filter(uint64_t hash);
+		void _count_write();
+
+		const std::string _location;
+
+		lmdb::env _env;
+		lmdb::dbi _dbi;
+		lmdb::txn _txn{nullptr};
+
+		std::size_t _writes{0};
+		std::vector<Filter> _filters;
 };
 
+// Keeps every entry in memory. With an overflow location, entries evicted once
+// the memory budget is reached are moved to an OverflowStore there instead of
+// being dropped, and lookups that miss in memory are served from it, moving
+// the entry back into memory. If the overflow store is only for thrashing, it
+// is not created until most of the entries stored are ones evicted shortly
+// before, which means the search is spending its time recomputing them. Given a snapshot file, every entry set is also
+// appended to it, so that a run that is stopped can resume from where it was.
+// New entries are collected and written as one block once the snapshot interval
+// has passed or enough of them have built up, when the cache is destroyed, and
+// when the process receives SIGTERM, after which it exits. Each block holds its
+// size and a checksum of its entries, so that a block cut short by the process
+// being killed is found and discarded. Later entries for a state replace
+// earlier ones when the file is loaded.
+//
+// The file starts with a signature of the route, parameters and variable
+// constraints, and is only loaded by a run that matches it, when the first
+// solve prepares the cache. Entries use packed keys, which are stable
+// for a given route, and the native byte order.
 class DynamicCache : public Cache {
 	public:
+		explicit DynamicCache(std::size_t memory_budget);
+		DynamicCache(std::size_t memory_budget, const std::string & overflow_location, bool overflow_for_thrashing, const std::string & snapshot_filename, Seconds snapshot_interval);
+		DynamicCache(const DynamicCache &) = delete;
+		DynamicCache(const DynamicCache &&) = delete;
+		auto operator=(const DynamicCache &) -> DynamicCache & = delete;
+		auto operator=(const DynamicCache &&) -> DynamicCache & = delete;
+
+		~DynamicCache() override;
+
 		auto get(const State & state) -> std::pair<int, Milliframes> override;
 		void set(const State & state, int value, Milliframes frames) override;
 
 		[[nodiscard]] auto get_size() const -> std::size_t override;
+		[[nodiscard]] auto get_tiers() const -> std::vector<CacheTier> override;
+
+		void prepare(uint64_t signature) override;
+		void poll() override;
 
 	private:
-		tsl::sparse_map<std::tuple<uint64_t, uint64_t, uint64_t>, std::pair<int, Milliframes>, boost::hash<std::tuple<uint64_t, uint64_t, uint64_t>>> _cache;
+		static constexpr uint32_t SNAPSHOT_VERSION = 1;
+		static constexpr std::size_t SNAPSHOT_BLOCK_SIZE = 1048576;
+		static constexpr std::size_t SNAPSHOT_POLL_INTERVAL = 4096;
+
+		// Recently evicted keys take four bits each in each of two filters,
+		// which fits in the twenty-fourth of the memory budget set aside.
+		static constexpr std::size_t EVICTED_KEYS_PER_WORD = 16;
+		static constexpr std::size_t EVICTED_FILTER_SHARE = 24;
+
+		struct SnapshotHeader {
+			std::array<char, 8> magic; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+			uint32_t version;
+			uint32_t entry_size;
+			uint64_t signature;
+		};
+
+		struct SnapshotBlock {
+			uint64_t size;
+			uint64_t checksum;
+		};
+
+		struct SnapshotEntry {
+			uint64_t key1;
+			uint64_t key2;
+			uint32_t frames;
+			uint16_t value;
+			uint16_t reserved;
+		};
+
+		static auto _get_checksum(const std::vector<SnapshotEntry> & entries) -> uint64_t;
+
+		void _store(const CacheKey & key, int value, Milliframes frames);
+		void _check_thrashing(const CacheKey & key, const CacheKey & evicted_key);
+
+		void _load_snapshot(uint64_t signature);
+		void _poll_snapshot();
+		void _write_snapshot();
+
+		CacheTable _cache;
+		CacheTier _memory_tier{"Memory"};
+
+		std::unique_ptr<OverflowStore> _overflow;
+		CacheTier _overflow_tier{"Overflow"};
+
+		// Bloom filters of the keys evicted in the current and the previous
+		// window, and the evictions and recomputations in the current one.
+		std::string _overflow_location;
+		std::array<std::vector<uint64_t>, 2> _evicted_filters;
+		std::size_t _eviction_window{0};
+		std::size_t _evictions{0};
+		std::size_t _recomputations{0};
+
+		bool _snapshot{false};
+		std::string _snapshot_filename;
+		std::ofstream _snapshot_file;
+		std::vector<SnapshotEntry> _snapshot_entries;
+		Seconds _snapshot_interval{0};
+		std::chrono::steady_clock::time_point _snapshot_time;
+		std::size_t _snapshot_polls{0};
 };
 
+// Stores every entry in an LMDB database as well as a bounded in-memory cache.
+// Keys start with the big-endian route index, so that entries written together
+// are stored together, followed by a database-specific party ID and the rest
+// of the state in big-endian or variable-length form. Values are stored as two
+// variable-length integers. Databases written before this format was versioned
+// must be converted with convert().
+//
+// The database also stores the route fingerprints it was written with. When
+// opened with a different route, entries for indices whose fingerprint is no
+// longer present are discarded, and the rest are moved to the matching index
+// of the new route.
 class PersistentCache : public Cache {
 	public:
-		explicit PersistentCache(const std::string & filename, std::size_t cache_size);
+		PersistentCache(const std::string & filename, const std::vector<uint64_t> & route, std::size_t memory_budget);
 		PersistentCache(const PersistentCache &) = delete;
 		PersistentCache(const PersistentCache &&) = delete;
 		auto operator=(const PersistentCache &) -> PersistentCache & = delete;
@@ -59,21 +246,136 @@ class PersistentCache : public Cache {
 		void set(const State & state, int value, Milliframes frames) override;
 
 		[[nodiscard]] auto get_size() const -> std::size_t override;
+		[[nodiscard]] auto get_tiers() const -> std::vector<CacheTier> override;
+
+		static auto needs_conversion(const std::string & filename) -> bool;
+		static auto convert(const std::string & filename) -> std::size_t;
 
 	private:
-		static auto _encode_key(std::tuple<uint64_t, uint64_t, uint64_t> keys) -> std::string;
-		static auto _encode_value(int value, Milliframes frames) -> std::string;
+		static constexpr std::size_t KEY_SIZE = 24;
+		static constexpr std::size_t VALUE_SIZE = 16;
+
+		// A write to the entries database, or to the parties database for a
+		// newly numbered party.
+		struct Write {
+			std::array<char, KEY_SIZE> key;
+			std::array<char, VALUE_SIZE> value;
+			uint8_t key_length;
+			uint8_t value_length;
+			bool party;
+		};
+
+		static void _open_environment(lmdb::env * env, const std::string & filename);
+		static auto _read_index(lmdb::txn * txn, lmdb::dbi * dbi, std::size_t index) -> std::vector<std::pair<std::string, std::string>>;
+
+		static auto _encode_key(const std::tuple<uint64_t, uint64_t, uint64_t> & keys, uint32_t party, std::array<char, KEY_SIZE> * data) -> std::size_t;
+		static auto _encode_value(int value, Milliframes frames, std::array<char, VALUE_SIZE> * data) -> std::size_t;
 		static auto _decode_value(const std::string_view & data) -> std::pair<int, Milliframes>;
 
-		void _flush_write_queue() noexcept;
+		void _update_route(lmdb::txn * txn, lmdb::dbi * metadata_dbi, const std::vector<uint64_t> & route);
 
-		tsl::sparse_map<std::tuple<uint64_t, uint64_t, uint64_t>, std::pair<int, Milliframes>, boost::hash<std::tuple<uint64_t, uint64_t, uint64_t>>> _cache;
-		std::map<std::string, std::string> _write_queue;
+		auto _find_party(const std::tuple<uint64_t, uint64_t, uint64_t> & keys, bool add) -> std::optional<uint32_t>;
+		void _store(const std::tuple<uint64_t, uint64_t, uint64_t> & keys, int value, Milliframes frames);
+		void _queue_batch();
+		void _write();
 
-		const std::size_t _cache_size;
+		CacheTable _cache;
+		CacheTier _memory_tier{"Memory"};
+		CacheTier _database_tier{"Database"};
 
 		lmdb::env _env;
-		lmdb::dbi _dbi;
+		lmdb::dbi _entries_dbi;
+		lmdb::dbi _parties_dbi;
+
+		// Parties are numbered in the order the database first saw them, and
+		// the numbering is stored alongside the entries. A new party is written
+		// in the same batch as the first entry that uses it.
+		std::map<std::pair<uint64_t, uint64_t>, uint32_t> _parties;
+
+		// Lookups share one read transaction, which is renewed whenever the
+		// writer has committed since it was last used.
+		lmdb::txn _read_txn{nullptr};
+		std::size_t _read_commits{0};
+
+		// Writes are collected into batches on the search thread and handed
+		// to a writer thread, which commits each batch in one transaction.
+		std::vector<Write> _batch;
+		std::deque<std::vector<Write>> _queue;
+		std::atomic<std::size_t> _commits{0};
+		bool _stopping{false};
+
+		std::mutex _mutex;
+		std::condition_variable _queue_changed;
+		std::thread _writer;
+};
+
+// Stores entries in an open-addressed hash table inside a memory-mapped file,
+// so that a lookup touches a single page and needs no transaction. The file
+// keeps the full key of each state and can be reopened by later runs. The table
+// size is always a power of two, and when the table fills up, it is rebuilt at
+// twice the size in a new file that then replaces the old one. The file uses
+// the native byte order.
+//
+// The route fingerprints the file was written with follow the table. When
+// opened with a different route, the table is rebuilt in the same way, keeping
+// only the entries for indices whose fingerprint is still present.
+class MappedCache : public Cache {
+	public:
+		MappedCache(const std::string & filename, const std::vector<uint64_t> & route);
+		MappedCache(const MappedCache &) = delete;
+		MappedCache(const MappedCache &&) = delete;
+		auto operator=(const MappedCache &) -> MappedCache & = delete;
+		auto operator=(const MappedCache &&) -> MappedCache && = delete;
+
+		~MappedCache() override;
+
+		auto get(const State & state) -> std::pair<int, Milliframes> override;
+		void set(const State & state, int value, Milliframes frames) override;
+
+		[[nodiscard]] auto get_size() const -> std::size_t override;
+		[[nodiscard]] auto get_tiers() const -> std::vector<CacheTier> override;
+
+	private:
+		static constexpr uint32_t VERSION = 2;
+		static constexpr std::size_t INITIAL_CAPACITY = 1048576;
+
+		struct Header {
+			std::array<char, 8> magic; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+			uint32_t version;
+			uint32_t entry_size;
+			uint64_t capacity;
+			uint64_t size;
+			uint64_t route_size;
+		};
+
+		// The value is stored plus one, so that the zero-filled pages of a
+		// newly extended file read as empty entries.
+		struct Entry {
+			uint64_t key1;
+			uint64_t key2;
+			uint64_t key3;
+			uint32_t frames;
+			uint16_t value;
+			uint16_t reserved;
+		};
+
+		[[nodiscard]] auto _find(const std::tuple<uint64_t, uint64_t, uint64_t> & keys) const -> Entry *;
+
+		void _map(const std::string & filename, std::size_t capacity, std::size_t route_size, bool create);
+		void _unmap();
+		void _rebuild(std::size_t capacity, const std::vector<uint64_t> & route, std::size_t first_index, std::ptrdiff_t offset);
+
+		const std::string _filename;
+
+		int _fd{-1};
+		void * _data{nullptr};
+		std::size_t _length{0};
+
+		Header * _header{nullptr};
+		Entry * _entries{nullptr};
+		uint64_t * _route{nullptr};
+
+		CacheTier _file_tier{"Mapped File"};
 };
 
 #endif // ROSA_CACHE_HH
@@ -0,0 +1,154 @@
+#include <algorithm>
+
+#include "cache_table.hh"
+
+// The table grows, or starts evicting, once it is three quarters full.
+constexpr std::size_t LOAD_FACTOR_NUMERATOR = 3;
+constexpr std::size_t LOAD_FACTOR_DENOMINATOR = 4;
+
+// With a memory budget, the table only doubles in size until it reaches this
+// fraction of its maximum capacity.
+constexpr std::size_t DOUBLING_FRACTION = 8;
+
+static auto get_capacity(std::size_t size) -> std::size_t {
+	std::size_t capacity{1};
+
+	while (capacity * LOAD_FACTOR_NUMERATOR < size * LOAD_FACTOR_DENOMINATOR) {
+		capacity *= 2;
+	}
+
+	return capacity;
+}
+
+CacheTable::CacheTable(std::size_t size_hint, std::size_t memory_budget) {
+	if (memory_budget > 0) {
+		_maximum_capacity = std::clamp(memory_budget / sizeof(Entry), MINIMUM_CAPACITY, MAXIMUM_CAPACITY);
+		_bounded = true;
+	}
+
+	_resize(std::min(_maximum_capacity, std::max(MINIMUM_CAPACITY, get_capacity(size_hint + 1))));
+}
+
+auto CacheTable::set(const CacheKey & key, int value, Milliframes frames) -> std::optional<CacheEntry> {
+	std::optional<CacheEntry> evicted;
+	auto position{_find(key)};
+
+	if (_entries[position].value == EMPTY_VALUE) {
+		if (_size + 1 > get_maximum_size()) {
+			auto capacity{_get_next_capacity()};
+
+			if (capacity > _entries.size()) {
+				_resize(capacity);
+			} else {
+				evicted = _evict();
+			}
+
+			position = _find(key);
+		}
+
+		_entries[position].key1 = key.first;
+		_entries[position].key2 = key.second;
+		_size++;
+	}
+
+	auto & entry{_entries[position]};
+
+	entry.value = static_cast<uint16_t>(value);
+	entry.frames = frames.count() >= UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(frames.count());
+	entry.referenced = 1;
+
+	return evicted;
+}
+
+auto CacheTable::get_size() const -> std::size_t {
+	return _size;
+}
+
+auto CacheTable::get_maximum_size() const -> std::size_t {
+	return _entries.size() * LOAD_FACTOR_NUMERATOR / LOAD_FACTOR_DENOMINATOR;
+}
+
+// The old table is kept until the new one is built, so with a memory budget,
+// both count towards it. Once the table has reached an eighth of its maximum
+// capacity, it grows straight to what is left of it, which is at least seven
+// eighths, and then starts evicting.
+auto CacheTable::_get_next_capacity() const -> std::size_t {
+	auto capacity{_entries.size()};
+
+	if (!_bounded) {
+		return std::min(MAXIMUM_CAPACITY, capacity * 2);
+	}
+
+	if (capacity * 2 <= _maximum_capacity / DOUBLING_FRACTION) {
+		return capacity * 2;
+	}
+
+	return _maximum_capacity - std::min(_maximum_capacity, capacity);
+}
+
+void CacheTable::_resize(std::size_t capacity) {
+	std::vector<Entry> entries(capacity, Entry{0, 0, 0, EMPTY_VALUE, 0});
+
+	std::swap(_entries, entries);
+
+	for (const auto & entry : entries) {
+		if (entry.value != EMPTY_VALUE) {
+			_entries[_find(CacheKey{entry.key1, entry.key2})] = entry;
+		}
+	}
+}
+
+auto CacheTable::_evict() -> CacheEntry {
+	auto hand{_get_home(CacheKey{_evictions++, 0})};
+	std::size_t candidates{0};
+	std::size_t victim{0};
+
+	while (candidates < EVICTION_CANDIDATES) {
+		auto & entry{_entries[hand]};
+
+		if (entry.value != EMPTY_VALUE) {
+			if (entry.referenced == 0) {
+				if (candidates == 0 || _get_index(entry.key2) > _get_index(_entries[victim].key2)) {
+					victim = hand;
+				}
+
+				candidates++;
+			} else {
+				entry.referenced = 0;
+			}
+		}
+
+		hand = _get_next(hand);
+	}
+
+	const auto & entry{_entries[victim]};
+	CacheEntry evicted{CacheKey{entry.key1, entry.key2}, entry.value, entry.frames == UINT32_MAX ? Milliframes::max() : Milliframes{entry.frames}};
+	_erase(victim);
+
+	return evicted;
+}
+
+// Removes an entry by shifting back any later entries in the same run that
+// would otherwise become unreachable, so that no tombstones are needed.
+void CacheTable::_erase(std::size_t position) {
+	auto hole{position};
+	auto next{_get_next(hole)};
+
+	while (_entries[next].value != EMPTY_VALUE) {
+		auto home{_get_home(CacheKey{_entries[next].key1, _entries[next].key2})};
+
+		// The entry can fill the hole unless its home lies cyclically in
+		// (hole, next], in which case it is already as close as it can be.
+		bool movable{hole <= next ? (home <= hole || home > next) : (home <= hole && home > next)};
+
+		if (movable) {
+			_entries[hole] = _entries[next];
+			hole = next;
+		}
+
+		next = _get_next(next);
+	}
+
+	_entries[hole].value = EMPTY_VALUE;
+	_size--;
+}
@@ -0,0 +1,132 @@
+#ifndef ROSA_CACHE_TABLE_HH
+#define ROSA_CACHE_TABLE_HH
+
+#include <cstdint>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "duration.hh"
+
+// Decisions are stored in 16 bits. One value is set aside for entries that only
+// hold a lower bound on the frames, because the search from that state was cut
+// short, and so have no decision.
+constexpr int BOUND_CACHE_VALUE = UINT16_MAX - 1;
+constexpr int MAXIMUM_CACHE_VALUE = BOUND_CACHE_VALUE - 1;
+
+using CacheKey = std::pair<uint64_t, uint64_t>;
+using CacheEntry = std::tuple<CacheKey, int, Milliframes>;
+
+// The 128-bit to 64-bit hash from CityHash.
+inline auto hash_cache_key(uint64_t low, uint64_t high) -> uint64_t {
+	const uint64_t multiplier{0x9DDFEA08EB382D69ULL};
+	const unsigned int shift{47};
+
+	auto a{(low ^ high) * multiplier};
+	a ^= a >> shift;
+
+	auto b{(high ^ a) * multiplier};
+	b ^= b >> shift;
+
+	return b * multiplier;
+}
+
+// An open-addressed hash table with linear probing, mapping the packed key of a
+// state to its cached decision and frame count. Each entry takes 24 bytes. The
+// decision must be at most MAXIMUM_CACHE_VALUE, and frame counts are stored in
+// 32 bits, so anything beyond about 19 hours is treated as unreachable.
+//
+// If given a memory budget, the table grows to use most of it, counting the old
+// table while the new one is built, and then evicts entries to make room for
+// new ones. Each entry has a reference bit that is set whenever it is used, and
+// an eviction sweeps the table from a pseudo-random position, clearing
+// reference bits until it has seen EVICTION_CANDIDATES entries without one. Of
+// those, it evicts the one furthest along the route, which has the least left
+// to search from it and so is the cheapest to recompute. Unlike CLOCK, there is
+// no persistent hand: one that carried on from where it stopped would leave the
+// table densest just ahead of it, where probe sequences grow long once the table
+// is full.
+class CacheTable {
+	public:
+		explicit CacheTable(std::size_t size_hint = 0, std::size_t memory_budget = 0);
+
+		[[nodiscard]] auto get(const CacheKey & key) -> std::pair<int, Milliframes> {
+			auto & entry{_entries[_find(key)]};
+
+			if (entry.value == EMPTY_VALUE) {
+				return std::make_pair(-1, Milliframes::max());
+			}
+
+			entry.referenced = 1;
+
+			return std::make_pair(static_cast<int>(entry.value), entry.frames == UINT32_MAX ? Milliframes::max() : Milliframes{entry.frames});
+		}
+
+		// Returns the entry that was evicted to make room for the new one, if
+		// any.
+		auto set(const CacheKey & key, int value, Milliframes frames) -> std::optional<CacheEntry>;
+
+		[[nodiscard]] auto get_size() const -> std::size_t;
+
+		// Returns the number of entries the table can hold before it grows or
+		// starts evicting.
+		[[nodiscard]] auto get_maximum_size() const -> std::size_t;
+
+	private:
+		static constexpr uint16_t EMPTY_VALUE = UINT16_MAX;
+		static constexpr std::size_t MINIMUM_CAPACITY = 1024;
+		static constexpr std::size_t MAXIMUM_CAPACITY = std::size_t{1} << 32U;
+		static constexpr std::size_t EVICTION_CANDIDATES = 8;
+		static constexpr unsigned int INDEX_SHIFT = 48;
+
+		struct Entry {
+			uint64_t key1;
+			uint64_t key2;
+			uint32_t frames;
+			uint16_t value;
+			uint8_t referenced;
+		};
+
+		// Maps the upper half of the hash onto the table, which need not be a
+		// power of two in size.
+		[[nodiscard]] auto _get_home(const CacheKey & key) const -> std::size_t {
+			const unsigned int shift{32};
+			return static_cast<std::size_t>(((hash_cache_key(key.first, key.second) >> shift) * _entries.size()) >> shift);
+		}
+
+		// The route index is the top of the second word of a packed key.
+		static auto _get_index(uint64_t key2) -> std::size_t {
+			return static_cast<std::size_t>(key2 >> INDEX_SHIFT);
+		}
+
+		[[nodiscard]] auto _get_next(std::size_t position) const -> std::size_t {
+			return position + 1 == _entries.size() ? 0 : position + 1;
+		}
+
+		// Returns the position of the entry for the key, or of the empty entry
+		// where it would be inserted.
+		[[nodiscard]] auto _find(const CacheKey & key) const -> std::size_t {
+			auto position{_get_home(key)};
+
+			while (_entries[position].value != EMPTY_VALUE && (_entries[position].key1 != key.first || _entries[position].key2 != key.second)) {
+				position = _get_next(position);
+			}
+
+			return position;
+		}
+
+		[[nodiscard]] auto _get_next_capacity() const -> std::size_t;
+
+		void _resize(std::size_t capacity);
+		auto _evict() -> CacheEntry;
+		void _erase(std::size_t position);
+
+		std::vector<Entry> _entries;
+		std::size_t _size{0};
+		std::size_t _maximum_capacity{MAXIMUM_CAPACITY};
+		bool _bounded{false};
+		uint64_t _evictions{0};
+};
+
+#endif // ROSA_CACHE_TABLE_HH
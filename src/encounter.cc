@@ -1,16 +1,21 @@
 #include "encounter.hh"
 
+#include "rng.hh"
 #include "state.hh"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/split.hpp>
 
+#include <algorithm>
+#include <array>
 #include <iostream>
 
 using namespace std::chrono_literals;
 
 const int MAXIMUM_ENCOUNTERS = 512;
 
+const std::array<int, 7> ENCOUNTER_GROUP_THRESHOLDS{43, 86, 129, 172, 204, 236, 252};
+
 Encounter::Encounter(std::size_t id, std::string description) : _id{id}, _description{std::move(description)} { }
 
 auto Encounter::get_id() const -> std::size_t {
@@ -25,10 +30,9 @@ void Encounter::add_duration(const Party & party, const Duration & duration) {
 	_durations[party] = duration;
 }
 
-auto Encounter::get_duration(const Party & party, bool minimum) const -> Milliframes {
+auto Encounter::get_duration(const Party & party, bool minimum) const -> std::optional<Milliframes> {
 	if (_durations.count(party) == 0) {
-		std::cerr << "WARNING: Party '" << party << "' not found for encounter " << _id << "... assuming 30 seconds\n";
-		return std::chrono::duration_cast<Milliframes>(30s);
+		return std::nullopt;
 	}
 
 	return minimum ? _durations.at(party).minimum : _durations.at(party).average;
@@ -73,12 +77,66 @@ auto Encounters::get_encounter(std::size_t id) const -> std::shared_ptr<const En
 	return _encounters[id];
 }
 
-auto Encounters::get_encounter_from_group(std::size_t group_index, std::size_t encounter_index) const -> std::shared_ptr<const Encounter> {
-	auto encounter{_encounters[_encounter_groups[group_index][encounter_index]]};
+auto Encounters::get_encounter_id_from_group(std::size_t group_index, std::size_t encounter_index) const -> std::size_t {
+	return _encounter_groups[group_index][encounter_index];
+}
+
+auto Encounters::get_size() const -> std::size_t {
+	return _encounters.size();
+}
+
+EncounterTable::EncounterTable(const Encounters & encounters, const Parties & parties, const std::vector<std::size_t> & groups, bool minimum) :
+		_party_count{parties.get_size()},
+		_durations(encounters.get_size() * parties.get_size(), std::chrono::duration_cast<Milliframes>(30s)),
+		_known_durations(encounters.get_size() * parties.get_size(), false) {
+	for (const auto & group_index : groups) {
+		if (_groups.size() <= group_index) {
+			_groups.resize(group_index + 1);
+		}
+
+		if (!_groups[group_index].empty()) {
+			continue;
+		}
+
+		_groups[group_index].resize(ENCOUNTER_TABLE_SIZE * ENCOUNTER_TABLE_SIZE);
+
+		for (std::size_t seed{0}; seed < ENCOUNTER_TABLE_SIZE; seed++) {
+			for (std::size_t index{0}; index < ENCOUNTER_TABLE_SIZE; index++) {
+				auto encounter_rng{static_cast<int>((static_cast<std::size_t>(RNG_DATA.at(index)) + seed) % ENCOUNTER_TABLE_SIZE)};
+				auto encounter_index{static_cast<std::size_t>(std::upper_bound(ENCOUNTER_GROUP_THRESHOLDS.begin(), ENCOUNTER_GROUP_THRESHOLDS.end(), encounter_rng) - ENCOUNTER_GROUP_THRESHOLDS.begin())};
+
+				_groups[group_index][seed * ENCOUNTER_TABLE_SIZE + index] = static_cast<uint16_t>(encounters.get_encounter_id_from_group(group_index, encounter_index));
+			}
+		}
+	}
+
+	for (std::size_t encounter_id{0}; encounter_id < encounters.get_size(); encounter_id++) {
+		auto encounter{encounters.get_encounter(encounter_id)};
+
+		if (!encounter) {
+			continue;
+		}
+
+		for (uint16_t party{0}; party < _party_count; party++) {
+			auto duration{encounter->get_duration(parties.get_party(party), minimum)};
+
+			if (duration) {
+				_durations[encounter_id * _party_count + party] = *duration;
+				_known_durations[encounter_id * _party_count + party] = true;
+			}
+		}
+	}
+}
+
+auto EncounterTable::has_duration(std::size_t encounter_id, uint16_t party) const -> bool {
+	return _known_durations[encounter_id * _party_count + party];
+}
 
-	if (!encounter) {
-		std::cerr << "WARNING: Attempted to use nonexistent encounter: " << _encounter_groups[group_index][encounter_index] << std::endl;
+// Returns the shortest duration of any encounter for any party.
+auto EncounterTable::get_minimum_duration() const -> Milliframes {
+	if (_durations.empty()) {
+		return 0_mf;
 	}
 
-	return encounter;
+	return *std::min_element(_durations.begin(), _durations.end());
 }
@@ -5,9 +5,12 @@
 #include "party.hh"
 
 #include <memory>
+#include <optional>
 #include <unordered_map>
 #include <vector>
 
+constexpr std::size_t ENCOUNTER_GROUP_SIZE = 8;
+
 class Encounter {
 	public:
 		Encounter(std::size_t id, std::string description);
@@ -16,7 +19,7 @@ class Encounter {
 		auto get_description() const -> std::string;
 
 		void add_duration(const Party & party, const Duration & duration);
-		auto get_duration(const Party & party, bool minimum) const -> Milliframes;
+		auto get_duration(const Party & party, bool minimum) const -> std::optional<Milliframes>;
 
 	private:
 		const std::size_t _id;
@@ -30,11 +33,41 @@ class Encounters {
 		explicit Encounters(std::istream & input);
 
 		[[nodiscard]] auto get_encounter(std::size_t id) const -> std::shared_ptr<const Encounter>;
-		[[nodiscard]] auto get_encounter_from_group(std::size_t group_index, std::size_t encounter_index) const -> std::shared_ptr<const Encounter>;
+		[[nodiscard]] auto get_encounter_id_from_group(std::size_t group_index, std::size_t encounter_index) const -> std::size_t;
+		[[nodiscard]] auto get_size() const -> std::size_t;
 
 	private:
 		std::vector<std::shared_ptr<Encounter>> _encounters;
 		std::vector<std::vector<std::size_t>> _encounter_groups;
 };
 
+// Precomputed encounter outcomes for the encounter groups and parties used by a
+// route. For each group, the encounter triggered at every encounter seed and
+// index is stored directly, and durations are stored for every combination of
+// encounter and interned party.
+class EncounterTable {
+	public:
+		EncounterTable(const Encounters & encounters, const Parties & parties, const std::vector<std::size_t> & groups, bool minimum);
+
+		[[nodiscard]] auto get_encounter_id(std::size_t group_index, int encounter_seed, int encounter_index) const -> std::size_t {
+			return _groups[group_index][static_cast<std::size_t>(encounter_seed) * ENCOUNTER_TABLE_SIZE + static_cast<std::size_t>(encounter_index)];
+		}
+
+		[[nodiscard]] auto get_duration(std::size_t encounter_id, uint16_t party) const -> Milliframes {
+			return _durations[encounter_id * _party_count + party];
+		}
+
+		[[nodiscard]] auto has_duration(std::size_t encounter_id, uint16_t party) const -> bool;
+		[[nodiscard]] auto get_minimum_duration() const -> Milliframes;
+
+	private:
+		static constexpr std::size_t ENCOUNTER_TABLE_SIZE = 256;
+
+		std::size_t _party_count;
+
+		std::vector<std::vector<uint16_t>> _groups;
+		std::vector<Milliframes> _durations;
+		std::vector<bool> _known_durations;
+};
+
 #endif // ROSA_ENCOUNTER_HH
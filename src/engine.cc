@@ -1,18 +1,29 @@
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <map>
 #include <numeric>
 
 #include <boost/format.hpp>
 #include <boost/range/adaptor/indexed.hpp>
 
-#include "peglib.h"
-
 #include "engine.hh"
+#include "memory.hh"
 #include "version.hh"
 
-constexpr int SEED_UPDATE_DELTA = 17;
 constexpr auto FRAMES_PER_TRANSITION = 82_f;
 constexpr auto FRAMES_PER_TILE = 16_f;
 
+constexpr std::size_t LEVEL_BLOCK_SIZE = 16384;
+
+// Branch and bound passes this much more than the remaining budget on to later
+// states, so a state reached again with a slightly larger budget can reuse its
+// lower bound rather than being searched again.
+constexpr auto BUDGET_MARGIN = 60_f;
+
+// In low memory mode, only one decision in this many is cached.
+constexpr std::size_t CHECKPOINT_INTERVAL = 16;
+
 auto search_expression_next_token(const std::string & expression, std::size_t & index) -> std::string {
 	while (expression.at(index) == ' ') {
 		index++;
@@ -29,17 +40,132 @@ auto search_expression_next_token(const std::string & expression, std::size_t &
 	return expression.substr(original_index, length);
 }
 
+static auto get_elapsed(std::chrono::steady_clock::time_point start) -> Seconds {
+	return std::chrono::steady_clock::now() - start;
+}
+
+// Returns the encounters that a logged instruction shows the player, by step and
+// encounter, leaving out those that are only listed as possible.
+static auto get_seen_encounters(const LogEntry & entry) -> std::vector<std::pair<int, int>> {
+	std::vector<std::pair<int, int>> encounters;
+
+	for (const auto & [step, encounter_index, encounter_id, frames] : entry.encounters) {
+		if (step <= entry.steps) {
+			encounters.emplace_back(step, encounter_id);
+		}
+	}
+
+	return encounters;
+}
+
+// Returns the extra tiles walked and steps taken for the given number of extra
+// steps in a PATH. Optional steps are used first, and any remaining extra steps
+// are taken in pairs, unless a single step is possible.
+static auto get_extra_steps(const CompiledInstruction & instruction, int value) -> std::pair<int, int> {
+	if (value <= 0) {
+		return std::make_pair(0, 0);
+	}
+
+	int optional_steps{std::min(instruction.optional_steps, value)};
+	int extra_steps{value - optional_steps};
+
+	if (extra_steps % 2 == 1 && optional_steps > 0) {
+		extra_steps++;
+		optional_steps--;
+	}
+
+	if (extra_steps % 2 == 1 && !instruction.can_single_step) {
+		extra_steps--;
+	}
+
+	int tiles{instruction.can_double_step ? extra_steps : extra_steps * 2};
+
+	if (tiles % 2 == 1) {
+		tiles++;
+	}
+
+	return std::make_pair(tiles, optional_steps + extra_steps);
+}
+
 Engine::Engine(Parameters parameters) : _parameters{std::move(parameters)} {
-	switch (parameters.cache_type) {
+	switch (_parameters.cache_type) {
 		case CacheType::Dynamic:
-			_cache = std::make_unique<DynamicCache>();
+			if (_parameters.snapshot_location.empty() && _parameters.overflow_location.empty()) {
+				_cache = std::make_unique<DynamicCache>(_parameters.cache_size);
+			} else {
+				_cache = std::make_unique<DynamicCache>(_parameters.cache_size, _parameters.overflow_location, _parameters.overflow_for_thrashing, _parameters.snapshot_location, _parameters.snapshot_interval);
+			}
+
+			break;
+		case CacheType::Mapped:
+			_cache = std::make_unique<MappedCache>(_parameters.cache_location, _get_route_fingerprints());
 			break;
 		case CacheType::Persistent:
-			_cache = std::make_unique<PersistentCache>(_parameters.cache_location, _parameters.cache_size);
+			_cache = std::make_unique<PersistentCache>(_parameters.cache_location, _get_route_fingerprints(), _parameters.cache_size);
 			break;
 	}
 
+	if (_parameters.threads > 1) {
+		_pool = std::make_unique<ThreadPool>(static_cast<std::size_t>(_parameters.threads));
+	}
+
+	_step_tables.resize(RNG_SIZE + 1);
+
+	std::vector<std::size_t> encounter_groups;
+
 	for (const auto & instruction : _parameters.route) {
+		CompiledInstruction compiled;
+
+		compiled.first_battle_penalty = instruction.first_battle_penalty;
+		compiled.variable = instruction.variable;
+		compiled.number = instruction.number;
+		compiled.tiles = instruction.tiles;
+		compiled.required_steps = instruction.required_steps;
+		compiled.optional_steps = instruction.optional_steps;
+		compiled.transition_count = instruction.transition_count;
+		compiled.type = instruction.type;
+		compiled.can_single_step = instruction.can_single_step;
+		compiled.can_double_step = instruction.can_double_step;
+		compiled.end_search = instruction.end_search;
+
+		if (instruction.type == InstructionType::Path) {
+			const auto & map{_parameters.maps.get_map(instruction.map)};
+			auto encounter_rate{static_cast<std::size_t>(std::clamp(map.encounter_rate, 0, RNG_SIZE))};
+
+			if (!_step_tables[encounter_rate]) {
+				_step_tables[encounter_rate] = std::make_unique<StepTable>(static_cast<int>(encounter_rate));
+			}
+
+			compiled.step_table = _step_tables[encounter_rate].get();
+			compiled.encounter_group = static_cast<uint16_t>(map.encounter_group);
+
+			if (encounter_rate > 0) {
+				encounter_groups.push_back(static_cast<std::size_t>(map.encounter_group));
+			}
+		}
+
+		if (instruction.type == InstructionType::Choice) {
+			compiled.target = static_cast<uint32_t>(_options.size());
+			_options.insert(_options.end(), instruction.targets.begin(), instruction.targets.end());
+		} else if (instruction.type == InstructionType::Option) {
+			compiled.target = static_cast<uint32_t>(instruction.targets.empty() ? _parameters.route.size() : instruction.targets.front());
+		}
+
+		if (instruction.type == InstructionType::Party) {
+			compiled.party = _parties.add_party(instruction.text);
+		} else if (instruction.type == InstructionType::Search) {
+			compiled.party = _parties.add_party(instruction.party);
+			compiled.search = instruction.search.get();
+		}
+
+		_instructions.push_back(compiled);
+
+		if (instruction.type == InstructionType::Route) {
+			_route_title = instruction.text;
+		} else if (instruction.type == InstructionType::Version) {
+			_route_version = instruction.number;
+		}
+
 		if (instruction.variable >= 0) {
 			if (_variables.count(instruction.variable) == 0) {
 				switch (instruction.type) {
@@ -64,248 +190,1343 @@ Engine::Engine(Parameters parameters) : _parameters{std::move(parameters)} {
 			}
 		}
 	}
-}
 
-void Engine::set_variable_minimum(int variable, int value) {
-	_variables[variable].minimum = value;
-}
+	_encounter_table = std::make_unique<const EncounterTable>(_parameters.encounters, _parties, encounter_groups, _parameters.tas_mode);
+	_suffix_bounds = _get_suffix_bounds();
+
+	if (_parameters.statistics) {
+		_statistics = std::make_unique<EngineStatistics>();
+		_statistics->states.resize(_parameters.route.size());
+		_statistics->evaluations.resize(_parameters.route.size());
+	}
+}
+
+// Returns a fingerprint for each route index, covering everything a cached
+// value for a state at that index depends on: the instructions from the index
+// onward, the parameters, and any search that may still be active. The step
+// segment parameters are left out, as the remaining segments are part of the
+// state, so that the cache can be reused across them as before. A search is
+// only known to have ended at a WAIT outside of any CHOICE, since one inside a
+// CHOICE may not be reached.
+auto Engine::_get_route_fingerprints() const -> std::vector<uint64_t> {
+	const auto & route{_parameters.route};
+
+	std::vector<uint64_t> searches(route.size() + 1, 0);
+	uint64_t search{0};
+	int depth{0};
+
+	for (std::size_t index{0}; index < route.size(); index++) {
+		const auto & instruction{route[index]};
+		searches[index] = search;
+
+		if (instruction.type == InstructionType::Choice) {
+			depth++;
+		} else if (instruction.type == InstructionType::End) {
+			depth--;
+		} else if (instruction.type == InstructionType::Search) {
+			search = hash_cache_key(search, instruction.fingerprint);
+		}
+
+		if (instruction.end_search && depth == 0) {
+			search = 0;
+		}
+	}
+
+	searches[route.size()] = search;
+
+	std::vector<uint64_t> fingerprints(route.size() + 1);
+	fingerprints[route.size()] = hash_cache_key(hash_cache_key(static_cast<uint64_t>(_parameters.maximum_extra_steps), static_cast<uint64_t>(_parameters.tas_mode)), searches[route.size()]);
+
+	for (auto index{route.size()}; index > 0; index--) {
+		fingerprints[index - 1] = hash_cache_key(hash_cache_key(fingerprints[index], route[index - 1].fingerprint), searches[index - 1]);
+	}
+
+	return fingerprints;
+}
+
+// Returns a signature of everything the cached values depend on for the whole
+// route: the fingerprint of its first index and the variable constraints, which
+// may be changed after the engine is created.
+auto Engine::_get_cache_signature() const -> uint64_t {
+	std::map<int, std::pair<int, int>> constraints;
+
+	for (const auto & [key, variable] : _variables) {
+		constraints.emplace(key, std::make_pair(variable.minimum, variable.maximum));
+	}
+
+	auto signature{hash_cache_key(_get_route_fingerprints().front(), static_cast<uint64_t>(_parameters.always_allow_cache))};
+
+	for (const auto & [key, range] : constraints) {
+		auto packed_range{(static_cast<uint64_t>(range.first) << 32U) | static_cast<uint32_t>(range.second)}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+		signature = hash_cache_key(hash_cache_key(signature, static_cast<uint64_t>(key)), packed_range);
+	}
+
+	return signature;
+}
+
+// Returns a lower bound for each route index on the frames needed to finish the
+// route from there, whatever the decisions. This counts the transitions and
+// required tiles of each PATH and every DELAY, taking the cheaper option of
+// each CHOICE. Encounters are assumed to add nothing, apart from a first battle
+// penalty that more than cancels out the shortest encounter. If an encounter
+// could take negative time, no useful bound exists, and every bound is zero.
+auto Engine::_get_suffix_bounds() const -> std::vector<Milliframes> {
+	const auto & route{_parameters.route};
+	std::vector<Milliframes> bounds(route.size() + 1, 0_mf);
+
+	auto minimum_duration{_encounter_table->get_minimum_duration()};
+
+	if (minimum_duration < 0_mf) {
+		return bounds;
+	}
+
+	for (auto index{route.size()}; index-- > 0;) {
+		const auto & instruction{route[index]};
+		auto next{index + 1};
+
+		switch (instruction.type) {
+			case InstructionType::Choice: {
+				Milliframes bound{Milliframes::max()};
+
+				for (const auto & option : instruction.targets) {
+					bound = std::min(bound, bounds[option + 1]);
+				}
+
+				bounds[index] = instruction.transition_count * FRAMES_PER_TRANSITION + (bound == Milliframes::max() ? 0_mf : bound);
+				break;
+			}
+			case InstructionType::Delay:
+				bounds[index] = Frames{instruction.number} + bounds[next];
+				break;
+			case InstructionType::Option:
+				bounds[index] = bounds[instruction.targets.empty() ? route.size() : instruction.targets.front()];
+				break;
+			case InstructionType::Path:
+				bounds[index] = instruction.transition_count * FRAMES_PER_TRANSITION + instruction.tiles * FRAMES_PER_TILE + std::min(0_mf, minimum_duration + instruction.first_battle_penalty) + bounds[next];
+				break;
+			case InstructionType::Data:
+			case InstructionType::End:
+			case InstructionType::Note:
+			case InstructionType::Party:
+			case InstructionType::Route:
+			case InstructionType::Save:
+			case InstructionType::Search:
+			case InstructionType::Version:
+				bounds[index] = bounds[next];
+				break;
+		}
+	}
+
+	return bounds;
+}
+
+// Reports every encounter that could occur with a party that has no duration
+// data for it. The route is scanned linearly, so every party that is active at
+// any point before a segment is considered for each branch that follows.
+void Engine::check_encounter_data() const {
+	std::set<std::pair<uint16_t, std::size_t>> reported;
+	uint16_t party{0};
+	uint16_t search_party{0};
+	bool search_active{false};
+
+	for (std::size_t index{0}; index < _parameters.route.size(); index++) {
+		const auto & instruction{_parameters.route[index]};
+
+		switch (instruction.type) {
+			case InstructionType::Party:
+				party = _instructions[index].party;
+				break;
+			case InstructionType::Search:
+				search_party = _instructions[index].party;
+				search_active = true;
+				break;
+			case InstructionType::Path: {
+				const auto & map{_parameters.maps.get_map(instruction.map)};
+
+				if (map.encounter_rate <= 0) {
+					break;
+				}
+
+				for (std::size_t encounter_index{0}; encounter_index < ENCOUNTER_GROUP_SIZE; encounter_index++) {
+					auto encounter_id{_parameters.encounters.get_encounter_id_from_group(static_cast<std::size_t>(map.encounter_group), encounter_index)};
+
+					for (const auto & active_party : {party, search_party}) {
+						if ((active_party == search_party && !search_active) || reported.count(std::make_pair(active_party, encounter_id)) > 0) {
+							continue;
+						}
+
+						if (!_parameters.encounters.get_encounter(encounter_id)) {
+							std::cerr << "WARNING: Attempted to use nonexistent encounter: " << encounter_id << '\n';
+						} else if (!_encounter_table->has_duration(encounter_id, active_party)) {
+							std::cerr << "WARNING: Party '" << _parties.get_party(active_party) << "' not found for encounter " << encounter_id << "... assuming 30 seconds\n";
+						}
+
+						reported.emplace(active_party, encounter_id);
+					}
+				}
+
+				if (instruction.end_search) {
+					party = search_party;
+					search_active = false;
+				}
+
+				break;
+			}
+			case InstructionType::Choice:
+			case InstructionType::Data:
+			case InstructionType::Delay:
+			case InstructionType::End:
+			case InstructionType::Note:
+			case InstructionType::Option:
+			case InstructionType::Route:
+			case InstructionType::Save:
+			case InstructionType::Version:
+				break;
+		}
+	}
+}
+
+// Returns a report of the statistics kept so far: the time spent in each phase,
+// the peak memory, the lookups made in each tier of the cache, and the route
+// lines and variables where the most values were evaluated, hottest first.
+// Returns nothing if statistics are not enabled.
+auto Engine::get_statistics_report(std::size_t lines) const -> std::string {
+	if (!_statistics) {
+		return "";
+	}
+
+	const auto & statistics{*_statistics};
+	const double bytes_per_mebibyte{1024.0 * 1024.0}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+	const double percent{100.0}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+	std::string report{"STATISTICS\n"};
+
+	auto add_line = [&report](const std::string & label, const std::string & value) {
+		report += (boost::format("%-21s%s\n") % (label + ":") % value).str();
+	};
+
+	add_line("Solve Time", (boost::format("%0.3fs") % statistics.solve_time.count()).str());
+	add_line("Finalize Time", (boost::format("%0.3fs") % statistics.finalize_time.count()).str());
+	add_line("Base Route Time", (boost::format("%0.3fs") % statistics.base_time.count()).str());
+	add_line("Peak Memory", (boost::format("%0.1f MiB") % (static_cast<double>(get_peak_memory()) / bytes_per_mebibyte)).str());
+	add_line("States Expanded", std::to_string(std::accumulate(statistics.states.begin(), statistics.states.end(), std::size_t{0})));
+	add_line("Evaluations", std::to_string(std::accumulate(statistics.evaluations.begin(), statistics.evaluations.end(), std::size_t{0})));
+	add_line("Cache Entries", std::to_string(_cache->get_size()));
+
+	for (const auto & tier : _cache->get_tiers()) {
+		auto lookups{tier.hits + tier.misses};
+		auto rate{lookups > 0 ? percent * static_cast<double>(tier.hits) / static_cast<double>(lookups) : 0.0};
+
+		add_line(tier.name + " Cache", (boost::format("%d hits, %d misses (%0.1f%%)") % tier.hits % tier.misses % rate).str());
+	}
+
+	auto hottest_first = [](const auto & a, const auto & b) {
+		return std::make_pair(a.second.second, a.second.first) > std::make_pair(b.second.second, b.second.first);
+	};
+
+	std::vector<std::pair<std::size_t, std::pair<std::size_t, std::size_t>>> indices;
+	std::map<int, std::pair<std::size_t, std::size_t>> variable_totals;
+	std::map<int, std::size_t> variable_lines;
+
+	for (std::size_t index{0}; index < statistics.states.size(); index++) {
+		if (statistics.evaluations[index] == 0) {
+			continue;
+		}
+
+		indices.emplace_back(index, std::make_pair(statistics.states[index], statistics.evaluations[index]));
+
+		auto variable{_parameters.route[index].variable};
+
+		if (variable > 0) {
+			variable_totals[variable].first += statistics.states[index];
+			variable_totals[variable].second += statistics.evaluations[index];
+			variable_lines[variable]++;
+		}
+	}
+
+	std::stable_sort(indices.begin(), indices.end(), hottest_first);
+	indices.resize(std::min(indices.size(), lines));
+
+	report += (boost::format("\n%6s %12s %12s  %s\n") % "Index" % "States" % "Evaluations" % "Line").str();
+
+	for (const auto & [index, counts] : indices) {
+		report += (boost::format("%6d %12d %12d  %s\n") % index % counts.first % counts.second % _parameters.route[index].source).str();
+	}
+
+	std::vector<std::pair<int, std::pair<std::size_t, std::size_t>>> variables{variable_totals.begin(), variable_totals.end()};
+	std::stable_sort(variables.begin(), variables.end(), hottest_first);
+	variables.resize(std::min(variables.size(), lines));
+
+	report += (boost::format("\n%-8s %12s %12s %6s\n") % "Variable" % "States" % "Evaluations" % "Lines").str();
+
+	for (const auto & [variable, counts] : variables) {
+		report += (boost::format("%07X  %12d %12d %6d\n") % variable % counts.first % counts.second % variable_lines[variable]).str();
+	}
+
+	return report;
+}
+
+void Engine::set_variable_minimum(int variable, int value) {
+	_variables[variable].minimum = value;
+}
+
+void Engine::set_variable_maximum(int variable, int value) {
+	_variables[variable].maximum = value;
+}
+
+auto Engine::optimize(int seed) -> std::string {
+	return optimize(std::vector<int>{seed})[0];
+}
+
+auto Engine::optimize(const std::vector<int> & seeds) -> std::vector<std::string> {
+	int minimum_step_segments{-1};
+
+	if (_parameters.maximum_step_segments >= 0) {
+		if (_parameters.prefer_fewer_locations) {
+			minimum_step_segments = 0;
+		} else {
+			minimum_step_segments = _parameters.maximum_step_segments;
+		}
+	}
+
+	std::vector<State> states;
+
+	for (const auto & seed : seeds) {
+		auto state{_get_initial_state(seed)};
+
+		for (auto i{minimum_step_segments}; i <= _parameters.maximum_step_segments; i++) {
+			if (i >= 0) {
+				state.set_remaining_segments(static_cast<uint16_t>(i));
+			}
+
+			states.push_back(state);
+		}
+	}
+
+	auto solve_start{std::chrono::steady_clock::now()};
+	auto results{_solve(states)};
+	auto result{results.begin()};
+
+	if (_statistics) {
+		_statistics->solve_time += get_elapsed(solve_start);
+	}
+
+	std::vector<std::string> outputs;
+
+	for (const auto & seed : seeds) {
+		auto state{_get_initial_state(seed)};
+
+		Milliframes best_result{Milliframes::max()};
+		int best_step_segments{-1};
+
+		for (auto i{minimum_step_segments}; i <= _parameters.maximum_step_segments; i++, result++) {
+			if (*result < best_result) {
+				best_result = *result;
+				best_step_segments = i;
+			}
+		}
+
+		if (best_step_segments >= 0) {
+			state.set_remaining_segments(static_cast<uint16_t>(best_step_segments));
+		}
+
+		for (auto & [key, variable] : _variables) {
+			variable.value = 0;
+		}
+
+		auto finalize_start{std::chrono::steady_clock::now()};
+		auto log{_finalize(state)};
+
+		if (_statistics) {
+			_statistics->finalize_time += get_elapsed(finalize_start);
+		}
+
+		outputs.push_back(_generate_output(state, log));
+	}
+
+	return outputs;
+}
+
+// Generates the output for a seed by applying the given variable values to the
+// route directly, without solving or using the cache. Returns nothing if the
+// values no longer fit the route, such as an OPTION that no longer exists or a
+// search that is no longer completed.
+auto Engine::replay(int seed, const std::vector<std::pair<int, int>> & values) -> std::optional<std::string> {
+	std::unordered_map<int, int> route_values;
+
+	for (const auto & [variable, value] : values) {
+		if (_variables.count(variable) == 0) {
+			std::cerr << "WARNING: Variable " << (boost::format("%07X") % variable).str() << " is not in the route and will be ignored\n";
+		}
+
+		route_values[variable] = value;
+	}
+
+	for (auto & [key, variable] : _variables) {
+		variable.value = 0;
+	}
+
+	auto initial_state{_get_initial_state(seed)};
+
+	if (_parameters.maximum_step_segments >= 0) {
+		initial_state.set_remaining_segments(static_cast<uint16_t>(_parameters.maximum_step_segments));
+	}
+
+	State state{initial_state};
+	Log log;
+
+	while (state.get_index() < _parameters.route.size()) {
+		const auto & instruction{_parameters.route[state.get_index()]};
+		int value{0};
+
+		if (instruction.variable > 0 && route_values.count(instruction.variable) > 0) {
+			value = route_values.at(instruction.variable);
+		}
+
+		if (instruction.type == InstructionType::Choice && static_cast<std::size_t>(value) >= instruction.targets.size()) {
+			std::cerr << "ERROR: The route no longer has option " << value << " at index " << state.get_index() << '\n';
+			return std::nullopt;
+		}
+
+		if (_record(&state, &log, value) == Milliframes::max()) {
+			std::cerr << "ERROR: The route no longer completes the search ending at index " << state.get_index() << '\n';
+			return std::nullopt;
+		}
+	}
+
+	return _generate_output_text(initial_state, log);
+}
+
+// Resolves a pair of twin seeds, which cannot be told apart until their
+// encounters differ, so that both follow the same decisions until then, with
+// the least combined frames. Decisions before the given route index are always
+// shared. Each seed is also solved on its own first, which gives the loss of the
+// resolved routes and fills the cache that they share once they are apart.
+auto Engine::optimize_twins(int seed, int twin_seed, std::size_t shared_until) -> TwinRoutes {
+	std::vector<State> initial_states{_get_initial_state(seed), _get_initial_state(twin_seed)};
+
+	for (auto & state : initial_states) {
+		if (_parameters.maximum_step_segments >= 0) {
+			state.set_remaining_segments(static_cast<uint16_t>(_parameters.maximum_step_segments));
+		}
+	}
+
+	auto solve_start{std::chrono::steady_clock::now()};
+
+	TwinRoutes routes;
+	routes.independent_frames = _solve(initial_states);
+
+	_twin_shared_until = shared_until;
+	_twin_cache.clear();
+	_optimize_twins(initial_states[0], initial_states[1]);
+
+	if (_statistics) {
+		_statistics->solve_time += get_elapsed(solve_start);
+	}
+
+	for (auto & [key, variable] : _variables) {
+		variable.value = 0;
+	}
+
+	std::vector<State> states{initial_states};
+	std::vector<Log> logs(states.size());
+	bool apart{false};
+
+	while (!apart && states[0].get_index() < _parameters.route.size()) {
+		auto index{states[0].get_index()};
+		auto value{_twin_cache.at(std::make_pair(states[0].get_keys(), states[1].get_keys())).first};
+
+		_record(&states[0], &logs[0], value);
+		_record(&states[1], &logs[1], value);
+
+		apart = index >= _twin_shared_until && get_seen_encounters(logs[0].back()) != get_seen_encounters(logs[1].back());
+	}
+
+	std::vector<std::pair<int, int>> shared_values;
+
+	for (const auto & [key, variable] : _variables) {
+		shared_values.emplace_back(key, variable.value);
+	}
+
+	for (std::size_t i{0}; i < states.size(); i++) {
+		for (const auto & [key, value] : shared_values) {
+			_variables[key].value = value;
+		}
+
+		if (apart) {
+			auto finalize_start{std::chrono::steady_clock::now()};
+
+			for (const auto & entry : _finalize(states[i])) {
+				logs[i].push_back(entry);
+			}
+
+			if (_statistics) {
+				_statistics->finalize_time += get_elapsed(finalize_start);
+			}
+		}
+
+		routes.outputs.push_back(_generate_output(initial_states[i], logs[i]));
+		routes.frames.push_back(std::accumulate(logs[i].begin(), logs[i].end(), 0_mf, [](const auto a, const auto & entry) {
+			return a + entry.frames;
+		}));
+	}
+
+	return routes;
+}
+
+auto Engine::estimate_cost(int seed) -> std::size_t {
+	auto base_start{std::chrono::steady_clock::now()};
+	auto & base_engine{_get_base_engine()};
+	auto state{base_engine._get_initial_state(seed)};
+
+	base_engine._solve(std::vector<State>{state});
+
+	std::size_t encounters{0};
+
+	for (const auto & entry : base_engine._finalize(state)) {
+		encounters += entry.encounters.size();
+	}
+
+	if (_statistics) {
+		_statistics->base_time += get_elapsed(base_start);
+	}
+
+	return encounters;
+}
+
+auto Engine::_finalize(State state) -> Log {
+	Log log;
+
+	while (state.get_index() < _parameters.route.size()) {
+		const auto & instruction{_parameters.route[state.get_index()]};
+		auto value{_get_bounds(state).first};
+
+		// Only decisions are cached. The result may have been evicted from a
+		// bounded cache, only be a lower bound, or not have been cached away
+		// from a checkpoint, in which case it is recomputed with the solver in
+		// use, which stops at states that are still cached. The iterative
+		// solver is told to cache every decision up to the next checkpoint,
+		// so that this happens at most once per stretch between them.
+		if (_decisions[state.get_index()]) {
+			auto cached{_cache->get(state)};
+
+			if (cached.first < 0 || cached.first == BOUND_CACHE_VALUE) {
+				if (_parameters.solver == SolverType::Iterative) {
+					auto checkpoint{state.get_index() + 1};
+
+					while (checkpoint < _parameters.route.size() && !_checkpoints[checkpoint]) {
+						checkpoint++;
+					}
+
+					_optimize_iterative(std::vector<State>{state}, checkpoint);
+				} else {
+					_optimize(state);
+				}
+
+				cached = _cache->get(state);
+			}
+
+			value = cached.first;
+
+			if (value < 0) {
+				std::cerr << "BUG: _finalize() attempted to use uncached state...\n";
+			}
+		}
+
+		if (_parameters.maximum_extra_steps > 0 && instruction.variable > 0) {
+			if (_variables.at(instruction.variable).minimum == _variables.at(instruction.variable).maximum) {
+				value = _variables.at(instruction.variable).minimum;
+			}
+		}
+
+		_record(&state, &log, value);
+	}
+
+	return log;
+}
+
+// Applies a value to the state as _cycle() does, adding an entry for it to the
+// log, and then sets the variable and uses up a step segment as the generated
+// route does.
+auto Engine::_record(State * state, Log * log, int value) -> Milliframes {
+	const auto & instruction{_parameters.route[state->get_index()]};
+
+	log->emplace_back(LogEntry{*state});
+	auto frames{_cycle(state, &log->back(), value)};
+
+	if (value > 0) {
+		_variables[instruction.variable].value = value;
+
+		if (instruction.type == InstructionType::Path && state->get_remaining_segments() > 0 && _parameters.maximum_step_segments >= 0) {
+			state->set_remaining_segments(static_cast<uint16_t>(state->get_remaining_segments() - 1));
+		}
+	}
+
+	return frames;
+}
+
+// Returns the description shown for a logged instruction, if any, and the change
+// in nesting depth that follows it.
+auto Engine::_describe(const LogEntry & entry) const -> std::pair<std::string, int> {
+	const auto & instruction{_parameters.route[entry.state.get_index()]};
+
+	switch (instruction.type) {
+		case InstructionType::Path:
+			return std::make_pair(_parameters.maps.get_map(instruction.map).description, instruction.end_search ? -1 : 0);
+		case InstructionType::Choice:
+			return std::make_pair(entry.extra_text, 1);
+		case InstructionType::Search:
+			return std::make_pair(instruction.text, 1);
+		case InstructionType::Note:
+			return std::make_pair(instruction.text, 0);
+		case InstructionType::End:
+			return std::make_pair(std::string{}, -1);
+		case InstructionType::Data:
+		case InstructionType::Delay:
+		case InstructionType::Option:
+		case InstructionType::Party:
+		case InstructionType::Route:
+		case InstructionType::Save:
+		case InstructionType::Version:
+			break;
+	}
+
+	return std::make_pair(std::string{}, 0);
+}
+
+// Returns the optional and extra steps taken in a logged PATH.
+static auto split_steps(const Instruction & instruction, const LogEntry & entry) -> std::pair<int, int> {
+	auto steps{entry.steps - instruction.required_steps};
+	auto optional_steps{std::min(instruction.optional_steps, steps)};
+	auto extra_steps{steps - optional_steps};
+
+	if (extra_steps % 2 == 1 && optional_steps > 0) {
+		optional_steps--;
+		extra_steps++;
+	}
+
+	return std::make_pair(optional_steps, extra_steps);
+}
+
+// Returns the frames and the number of encounters for the seed without any
+// extra steps.
+auto Engine::_get_base_result(const State & state) -> std::pair<Milliframes, int> {
+	auto base_start{std::chrono::steady_clock::now()};
+	auto & base_engine{_get_base_engine()};
+	auto base_frames{base_engine._solve(std::vector<State>{state})[0]};
+	auto base_log{base_engine._finalize(state)};
+
+	auto base_encounters{std::accumulate(base_log.begin(), base_log.end(), 0, [](const auto a, const auto & entry) {
+		int encounters{0};
+
+		for (const auto & [step, encounter_index, encounter_id, frames] : entry.encounters) {
+			if (step <= entry.steps) {
+				encounters++;
+			}
+		}
+
+		return a + encounters;
+	})};
+
+	if (_statistics) {
+		_statistics->base_time += get_elapsed(base_start);
+	}
+
+	return std::make_pair(base_frames, base_encounters);
+}
+
+// Returns the variables set in the generated route, in order.
+auto Engine::_get_variable_values() const -> std::vector<std::pair<int, int>> {
+	std::vector<std::pair<int, int>> values;
+
+	for (const auto & [key, variable] : _variables) {
+		if (variable.value > 0) {
+			values.emplace_back(key, variable.value);
+		}
+	}
+
+	std::sort(values.begin(), values.end());
+
+	return values;
+}
+
+auto Engine::_generate_output(const State & state, const Log & log) -> std::string {
+	if (_parameters.output_format == OutputFormat::Json) {
+		return _generate_output_json(state, log);
+	}
+
+	return _generate_output_text(state, log);
+}
+
+auto Engine::_generate_output_text(const State & state, const Log & log) -> std::string {
+	Milliframes total_frames{0_mf};
+	Milliframes encounter_frames{0_mf};
+
+	int total_optional_steps{0};
+	int total_extra_steps{0};
+	int total_encounters{0};
+
+	std::string raw_output;
+	std::size_t indent_level{0};
+
+	for (const auto & entry : log) {
+		const auto & instruction{_parameters.route[entry.state.get_index()]};
+		const auto [description, depth_change] = _describe(entry);
+
+		if (!description.empty()) {
+			raw_output += (boost::format("%-78sSeed: %3d   Index: %3d\n") % (boost::format("%s%s") % std::string(indent_level * 2, ' ') % description).str() % entry.state.get_step_seed() % entry.state.get_step_index()).str();
+		}
+
+		if (entry.steps > 0 || instruction.optional_steps > 0) {
+			const auto [optional_steps, extra_steps] = split_steps(instruction, entry);
+
+			total_optional_steps += optional_steps;
+			total_extra_steps += extra_steps;
+
+			if (instruction.optional_steps > 0) {
+				raw_output += (boost::format("%sOptional Steps: %d\n") % std::string((indent_level + 1) * 2, ' ') % optional_steps).str();
+			}
+
+			if (extra_steps > 0) {
+				raw_output += (boost::format("%sExtra Steps: %d\n") % std::string((indent_level + 1) * 2, ' ') % extra_steps).str();
+			}
+		}
+
+		for (const auto & [step, encounter_index, encounter_id, frames] : entry.encounters) {
+			auto encounter{_parameters.encounters.get_encounter(static_cast<std::size_t>(encounter_id))};
+			if (step > entry.steps) {
+				raw_output += (boost::format("%s(Step %3d: %d / %s)\n") % std::string((indent_level + 1) * 2 - 1, ' ') % step % (encounter_index + 1) % encounter->get_description()).str();
+			} else {
+				raw_output += (boost::format("%sStep %3d: %d / %s (%0.3fs)\n") % std::string((indent_level + 1) * 2, ' ') % step % (encounter_index + 1) % encounter->get_description() % Seconds(frames).count()).str();
+				encounter_frames += frames;
+				total_encounters++;
+			}
+		}
+
+		total_frames += entry.frames;
+		indent_level += static_cast<std::size_t>(depth_change);
+	}
+
+	std::string output;
+
+	output += (boost::format("ROUTE\t%s\n") % _route_title).str();
+	output += (boost::format("VERSION\t%d\n") % _route_version).str();
+	output += (boost::format("ROSA\t%s\n") % ROSA_VERSION).str();
+	output += (boost::format("SEED\t%d\n") % state.get_step_seed()).str();
+	output += (boost::format("MAXSTEP\t%d\n") % _parameters.maximum_extra_steps).str();
+	output += (boost::format("MAXSEG\t%d\n") % _parameters.maximum_step_segments).str();
+	output += (boost::format("TASMODE\t%d\n") % (_parameters.tas_mode ? 1 : 0)).str();
+	output += (boost::format("MINIMUM\t%d\n") % (_parameters.maximum_step_segments >= 0 && _parameters.prefer_fewer_locations ? 1 : 0)).str();
+	output += (boost::format("FRAMES\t%d\n") % total_frames.count()).str();
+
+	std::string variable_output;
+
+	for (const auto & [key, value] : _get_variable_values()) {
+		variable_output += (variable_output.empty() ? "" : " ") + (boost::format("%07X:%d") % key % value).str();
+	}
+
+	output += (boost::format("VARS\t%s\n\n") % variable_output).str();
+	output += raw_output + '\n';
+	output += (boost::format("%-21s%0.3fs\n") % "Encounter Time:" % Seconds(encounter_frames).count()).str();
+	output += (boost::format("%-21s%0.3fs\n") % "Other Time:" % Seconds(total_frames - encounter_frames).count()).str();
+	output += (boost::format("%-21s%0.3fs\n\n") % "Total Time:" % Seconds(total_frames).count()).str();
+
+	auto [base_frames, base_encounters] = _get_base_result(state);
+
+	output += (boost::format("%-21s%0.3fs\n") % "Base Total Time:" % Seconds(base_frames).count()).str();
+	output += (boost::format("%-21s%0.3fs\n\n") % "Time Saved:" % Seconds(base_frames - total_frames).count()).str();
+
+	output += (boost::format("%-21s%d\n") % "Optional Steps:" % total_optional_steps).str();
+	output += (boost::format("%-21s%d\n") % "Extra Steps:" % total_extra_steps).str();
+	output += (boost::format("%-21s%d\n\n") % "Encounters:" % total_encounters).str();
+
+	output += (boost::format("%-21s%d\n") % "Base Encounters:" % base_encounters).str();
+	output += (boost::format("%-21s%d\n\n") % "Encounters Saved:" % (base_encounters - total_encounters)).str();
+
+	output += (boost::format("%-21s%d\n") % "Number of Variables:" % _variables.size()).str();
+
+	return output;
+}
+
+// Returns the text as a quoted JSON string.
+static auto quote_json(const std::string & text) -> std::string {
+	std::string output{"\""};
+
+	for (const auto & character : text) {
+		switch (character) {
+			case '"':
+				output += "\\\"";
+				break;
+			case '\\':
+				output += "\\\\";
+				break;
+			case '\n':
+				output += "\\n";
+				break;
+			case '\t':
+				output += "\\t";
+				break;
+			default:
+				if (static_cast<unsigned char>(character) < 0x20) { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+					output += (boost::format("\\u%04x") % static_cast<int>(character)).str();
+				} else {
+					output += character;
+				}
+
+				break;
+		}
+	}
+
+	return output + "\"";
+}
+
+// Generates the same route as _generate_output_text(), as a single line of JSON.
+// Every entry with a description, steps or encounters is listed, with its route
+// index and nesting depth. All frames are in milliframes.
+auto Engine::_generate_output_json(const State & state, const Log & log) -> std::string {
+	Milliframes total_frames{0_mf};
+	Milliframes encounter_frames{0_mf};
+
+	int total_optional_steps{0};
+	int total_extra_steps{0};
+	int total_encounters{0};
+
+	std::string entries;
+	int depth{0};
+
+	for (const auto & entry : log) {
+		const auto & instruction{_parameters.route[entry.state.get_index()]};
+		const auto [description, depth_change] = _describe(entry);
+
+		total_frames += entry.frames;
+
+		if (description.empty() && entry.steps == 0 && instruction.optional_steps == 0 && entry.encounters.empty()) {
+			depth += depth_change;
+			continue;
+		}
+
+		auto [optional_steps, extra_steps] = entry.steps > 0 || instruction.optional_steps > 0 ? split_steps(instruction, entry) : std::make_pair(0, 0);
+
+		total_optional_steps += optional_steps;
+		total_extra_steps += extra_steps;
+
+		std::string encounters;
+
+		for (const auto & [step, encounter_index, encounter_id, frames] : entry.encounters) {
+			auto encounter{_parameters.encounters.get_encounter(static_cast<std::size_t>(encounter_id))};
+			bool possible{step > entry.steps};
+
+			if (!possible) {
+				encounter_frames += frames;
+				total_encounters++;
+			}
+
+			encounters += (encounters.empty() ? "" : ",") + (boost::format(R"({"step":%d,"index":%d,"id":%d,"description":%s,"frames":%d,"possible":%s})") % step % (encounter_index + 1) % encounter_id % quote_json(encounter->get_description()) % frames.count() % (possible ? "true" : "false")).str();
+		}
+
+		entries += (entries.empty() ? "" : ",") + (boost::format(R"({"index":%d,"depth":%d,"description":%s,"seed":%d,"step_index":%d,"steps":%d,"optional_steps":%d,"extra_steps":%d,"frames":%d,"encounters":[%s]})") % entry.state.get_index() % depth % quote_json(description) % entry.state.get_step_seed() % entry.state.get_step_index() % entry.steps % optional_steps % extra_steps % entry.frames.count() % encounters).str();
+
+		depth += depth_change;
+	}
+
+	std::string variables;
+
+	for (const auto & [key, value] : _get_variable_values()) {
+		variables += (variables.empty() ? "" : ",") + (boost::format(R"("%07X":%d)") % key % value).str();
+	}
+
+	auto [base_frames, base_encounters] = _get_base_result(state);
+
+	std::string output{"{"};
+
+	output += (boost::format(R"("route":%s,"version":%d,"rosa":%s,"seed":%d,)") % quote_json(_route_title) % _route_version % quote_json(ROSA_VERSION) % state.get_step_seed()).str();
+	output += (boost::format(R"("maxstep":%d,"maxseg":%d,"tasmode":%s,"minimum":%s,)") % _parameters.maximum_extra_steps % _parameters.maximum_step_segments % (_parameters.tas_mode ? "true" : "false") % (_parameters.maximum_step_segments >= 0 && _parameters.prefer_fewer_locations ? "true" : "false")).str();
+	output += (boost::format(R"("frames":%d,"vars":{%s},"entries":[%s],)") % total_frames.count() % variables % entries).str();
+	output += (boost::format(R"("summary":{"encounter_frames":%d,"other_frames":%d,"total_frames":%d,"base_frames":%d,"saved_frames":%d,)") % encounter_frames.count() % (total_frames - encounter_frames).count() % total_frames.count() % base_frames.count() % (base_frames - total_frames).count()).str();
+	output += (boost::format(R"("optional_steps":%d,"extra_steps":%d,"encounters":%d,"base_encounters":%d,"encounters_saved":%d,"variables":%d}})") % total_optional_steps % total_extra_steps % total_encounters % base_encounters % (base_encounters - total_encounters) % _variables.size()).str();
+
+	return output + "\n";
+}
+
+auto Engine::_get_base_engine() -> Engine & {
+	if (!_base_engine) {
+		_base_engine = std::make_unique<Engine>(Parameters{_parameters.route, _parameters.encounters, _parameters.maps, 0, _parameters.tas_mode, false, true, -1, CacheType::Dynamic, "", 0, _parameters.solver, 1, false, _parameters.low_memory, OutputFormat::Text});
+	}
+
+	return *_base_engine;
+}
+
+auto Engine::_get_initial_state(int seed) const -> State {
+	State state{seed};
+	state.set_party(_parties, 0);
+
+	return state;
+}
+
+// Solves from each state, after first advancing it to the first decision.
+auto Engine::_solve(const std::vector<State> & states) -> std::vector<Milliframes> {
+	_update_decisions();
+	_cache->prepare(_get_cache_signature());
+
+	std::vector<State> starts{states};
+	std::vector<Milliframes> offsets;
+
+	for (auto & start : starts) {
+		offsets.push_back(_skip_fixed(&start));
+	}
+
+	std::vector<Milliframes> results;
+
+	if (_parameters.solver == SolverType::Iterative) {
+		results = _optimize_iterative(starts);
+	} else {
+		for (const auto & start : starts) {
+			results.push_back(_optimize(start));
+		}
+	}
+
+	for (std::size_t i{0}; i < results.size(); i++) {
+		results[i] = offsets[i] == Milliframes::max() ? Milliframes::max() : results[i] + offsets[i];
+	}
+
+	return results;
+}
+
+// Marks the route indices where a decision has to be made: those with a
+// variable that can take more than one value, and any PATH that ends a search,
+// since more steps may be needed to complete it. Every other instruction is
+// fixed, and is applied directly when reached, without a cache entry. Also marks
+// the decisions the iterative solver caches, which in low memory mode are only
+// every CHECKPOINT_INTERVAL-th one.
+void Engine::_update_decisions() {
+	const auto & route{_parameters.route};
+	_decisions.assign(route.size(), false);
+	_checkpoints.assign(route.size(), false);
+
+	std::size_t decision_count{0};
+
+	for (std::size_t index{0}; index < route.size(); index++) {
+		const auto & instruction{route[index]};
+
+		if (instruction.variable > 0) {
+			const auto & variable{_variables.at(instruction.variable)};
+			_decisions[index] = variable.minimum != variable.maximum;
+		}
+
+		if (instruction.type == InstructionType::Path && instruction.end_search) {
+			_decisions[index] = true;
+		}
+
+		if (_decisions[index]) {
+			_checkpoints[index] = !_parameters.low_memory || decision_count % CHECKPOINT_INTERVAL == 0;
+			decision_count++;
+		}
+	}
+}
+
+// Applies fixed instructions from the state until it reaches a decision or the
+// end of the route, and returns their frames.
+auto Engine::_skip_fixed(State * state) -> Milliframes {
+	Milliframes frames{0};
+
+	while (state->get_index() < _parameters.route.size() && !_decisions[state->get_index()]) {
+		auto value{_get_bounds(*state).first};
+		*state = _get_work_state(*state, value);
+
+		auto result{_cycle(state, nullptr, value)};
+
+		if (result == Milliframes::max()) {
+			return result;
+		}
+
+		frames += result;
+	}
+
+	return frames;
+}
+
+// Returns the best result from the state if it is less than the limit, and
+// otherwise a lower bound on it that is at least the limit. With branch and
+// bound, a decision is only searched while it could still beat both the limit
+// and the best decision so far, according to the suffix bounds, and what
+// remains of that budget, plus a margin, is passed on as the limit for the next
+// state. A lower bound is cached as such, and is only reused by a search with a
+// limit it already meets. Only the decision itself can be infeasible, when it
+// leaves a search incomplete, so a decision that is cut short still counts as
+// feasible.
+// Extra steps past the maximum are only tried while no decision is feasible,
+// and never past the largest value the cache can hold.
+auto Engine::_optimize(const State & state, Milliframes limit) -> Milliframes {
+	if (state.get_index() == _parameters.route.size()) {
+		return 0_mf;
+	}
+
+	auto [value, frames] = _cache->get(state);
+	bool update_cache{value < 0 || value == BOUND_CACHE_VALUE};
+
+	auto [minimum, maximum] = _get_bounds(state);
+
+	if (value >= 0 && (minimum != maximum || _parameters.always_allow_cache) && (value != BOUND_CACHE_VALUE || frames >= limit)) {
+		return frames;
+	}
+
+	value = -1;
+	frames = Milliframes::max();
+
+	bool feasible{false};
+
+	PathWalk walk;
+
+	if (_statistics) {
+		_statistics->states[state.get_index()]++;
+	}
+
+	for (int i = minimum; i <= maximum || (!feasible && i <= MAXIMUM_CACHE_VALUE); i++) {
+		auto [work_state, result] = _apply(state, &walk, i);
+
+		if (_statistics) {
+			_statistics->evaluations[state.get_index()]++;
+		}
+
+		if (result < Milliframes::max()) {
+			feasible = true;
+
+			if (_parameters.branch_and_bound) {
+				auto budget{std::min(limit, frames) - result};
+				auto bound{_suffix_bounds[work_state.get_index()]};
+				auto margin{Milliframes{BUDGET_MARGIN}};
+
+				result += bound >= budget ? bound : _optimize(work_state, budget > Milliframes::max() - margin ? Milliframes::max() : budget + margin);
+			} else {
+				result += _optimize(work_state);
+			}
+		}
+
+		if (result < frames) {
+			value = i;
+			frames = result;
+		}
+	}
+
+	if (frames >= limit) {
+		value = BOUND_CACHE_VALUE;
+	}
+
+	if (update_cache) {
+		_cache->set(state, value, frames);
+	}
+
+	return frames;
+}
+
+// Returns the best combined frames for two twin seeds at the same route index.
+// They make the same decisions until their encounters differ, and from there
+// each continues with its own best route. The decision for the instruction
+// where they first differ is still shared, as its extra steps may be taken
+// before the encounter that tells them apart. Every instruction is applied one
+// at a time, so that they are told apart as early as possible.
+auto Engine::_optimize_twins(const State & first, const State & second) -> Milliframes {
+	if (first.get_index() == _parameters.route.size()) {
+		return 0_mf;
+	}
+
+	auto key{std::make_pair(first.get_keys(), second.get_keys())};
+	auto cached{_twin_cache.find(key)};
+
+	if (cached != _twin_cache.end()) {
+		return cached->second.second;
+	}
+
+	auto [minimum, maximum] = _get_bounds(first);
+
+	int value{-1};
+	Milliframes frames{Milliframes::max()};
+	bool feasible{false};
+
+	if (_statistics) {
+		_statistics->states[first.get_index()]++;
+	}
+
+	for (int i = minimum; i <= maximum || (!feasible && i <= MAXIMUM_CACHE_VALUE); i++) {
+		auto [first_state, second_state, result, apart] = _cycle_twins(first, second, i);
+
+		if (_statistics) {
+			_statistics->evaluations[first.get_index()]++;
+		}
+
+		if (result < Milliframes::max()) {
+			feasible = true;
+
+			auto first_result{apart ? _finish_twin(first_state) : _optimize_twins(first_state, second_state)};
+			auto second_result{apart ? _finish_twin(second_state) : 0_mf};
+
+			result = first_result == Milliframes::max() || second_result == Milliframes::max() ? Milliframes::max() : result + first_result + second_result;
+		}
+
+		if (result < frames) {
+			value = i;
+			frames = result;
+		}
+	}
+
+	_twin_cache.emplace(key, std::make_pair(value, frames));
 
-void Engine::set_variable_maximum(int variable, int value) {
-	_variables[variable].maximum = value;
+	return frames;
 }
 
-auto Engine::optimize(int seed) -> std::string {
-	State state{seed};
+// Applies a value to both twin seeds, returning their new states, their
+// combined frames, and whether they can now be told apart.
+auto Engine::_cycle_twins(const State & first, const State & second, int value) -> std::tuple<State, State, Milliframes, bool> {
+	State first_state{_get_work_state(first, value)};
+	State second_state{_get_work_state(second, value)};
+	LogEntry first_log{first};
+	LogEntry second_log{second};
 
-	int minimum_step_segments{-1};
+	auto first_frames{_cycle(&first_state, &first_log, value)};
+	auto second_frames{_cycle(&second_state, &second_log, value)};
 
-	if (_parameters.maximum_step_segments >= 0) {
-		if (_parameters.prefer_fewer_locations) {
-			minimum_step_segments = 0;
-		} else {
-			minimum_step_segments = _parameters.maximum_step_segments;
-		}
+	if (first_frames == Milliframes::max() || second_frames == Milliframes::max()) {
+		return std::make_tuple(first_state, second_state, Milliframes::max(), false);
 	}
 
-	Milliframes best_result{Milliframes::max()};
-	int best_step_segments{-1};
+	bool apart{first.get_index() >= _twin_shared_until && get_seen_encounters(first_log) != get_seen_encounters(second_log)};
 
-	for (auto i{minimum_step_segments}; i <= _parameters.maximum_step_segments; i++) {
-		if (i >= 0) {
-			state.remaining_segments = static_cast<uint16_t>(i);
-		}
+	return std::make_tuple(first_state, second_state, first_frames + second_frames, apart);
+}
 
-		auto result{_optimize(state)};
+// Returns the best frames for one twin seed once it is apart from the other.
+auto Engine::_finish_twin(State state) -> Milliframes {
+	auto frames{_skip_fixed(&state)};
 
-		if (result < best_result) {
-			best_result = result;
-			best_step_segments = i;
-		}
-	}
+	return frames == Milliframes::max() ? frames : frames + _optimize(state);
+}
+
+// Solves the same problem as _optimize(), but without recursion, and for any
+// number of initial states at once, so that states shared between them are
+// only expanded a single time. Reachable states are first discovered one route
+// index at a time, and are then evaluated in reverse index order, so every
+// successor is already known by the time its predecessors need it. Since each
+// transition strictly increases the route index, a level can be released as
+// soon as its lowest predecessor has been evaluated. States within a level are
+// independent of each other, so each block of them is expanded and evaluated in
+// parallel, while the cache is only accessed between blocks, in order, to keep
+// the results deterministic. The cache is also polled before each block, so
+// that a snapshot or SIGTERM does not wait for enough lookups to trigger it.
+// Only states at checkpoints, or before the given route index, are written to
+// the cache.
+void Level::seal() {
+	std::sort(states.begin(), states.end(), [](const State & a, const State & b) {
+		return a.get_keys() < b.get_keys();
+	});
+
+	positions = decltype(positions){};
+	sealed = true;
+}
 
-	if (best_step_segments >= 0) {
-		state.remaining_segments = static_cast<uint16_t>(best_step_segments);
+auto Level::get_position(const State & state) const -> std::size_t {
+	if (!sealed) {
+		return positions.at(state.get_keys());
 	}
 
-	auto log{_finalize(state)};
+	auto keys{state.get_keys()};
 
-	return _generate_output_text(state, log);
+	return static_cast<std::size_t>(std::lower_bound(states.begin(), states.end(), keys, [](const State & a, const auto & b) {
+		return a.get_keys() < b;
+	}) - states.begin());
 }
 
-auto Engine::_finalize(State state) -> Log {
-	Log log;
+auto Engine::_optimize_iterative(const std::vector<State> & states, std::size_t cache_until) -> std::vector<Milliframes> {
+	const auto route_size{_parameters.route.size()};
 
-	while (state.index < _parameters.route.size()) {
-		auto instruction = _parameters.route[state.index];
-		auto [value, frames] = _cache->get(state);
+	std::vector<Milliframes> results(states.size(), 0_mf);
+	std::vector<Level> levels(route_size);
+	std::vector<std::size_t> release_index(route_size, route_size);
 
-		if (value < 0) {
-			std::cerr << "BUG: _finalize() attempted to use uncached state...\n";
-		}
+	auto discover = [&levels](const State & new_state) {
+		auto & level{levels[new_state.get_index()]};
+		auto keys{new_state.get_keys()};
 
-		if (_parameters.maximum_extra_steps > 0 && instruction.variable > 0) {
-			if (_variables.at(instruction.variable).minimum == _variables.at(instruction.variable).maximum) {
-				value = _variables.at(instruction.variable).minimum;
-			}
+		if (level.positions.count(keys) == 0) {
+			level.positions.emplace(keys, level.states.size());
+			level.states.push_back(new_state);
+			level.frames.push_back(Milliframes::max());
+			level.status.push_back(LevelStatus::Resolved);
 		}
+	};
 
-		log.emplace_back(LogEntry{state});
-		_cycle(&state, &log[log.size() - 1], value);
+	auto start_index{route_size};
 
-		if (value > 0) {
-			_variables[instruction.variable].value = value;
-
-			if (instruction.type == InstructionType::Path && state.remaining_segments > 0 && _parameters.maximum_step_segments >= 0) {
-				state.remaining_segments--;
-			}
+	for (const auto & state : states) {
+		if (state.get_index() < route_size) {
+			start_index = std::min(start_index, state.get_index());
+			discover(state);
 		}
 	}
 
-	return log;
-}
+	for (auto index{start_index}; index < route_size; index++) {
+		auto & level{levels[index]};
 
-auto Engine::_generate_output_text(const State & state, const Log & log) -> std::string {
-	Milliframes total_frames{0_mf};
-	Milliframes encounter_frames{0_mf};
+		if (_parameters.low_memory) {
+			level.seal();
+		}
 
-	int total_optional_steps{0};
-	int total_extra_steps{0};
-	int total_encounters{0};
+		for (std::size_t begin{0}; begin < level.states.size(); begin += LEVEL_BLOCK_SIZE) {
+			_cache->poll();
 
-	std::string raw_output;
-	std::size_t indent_level{0};
+			auto end{std::min(level.states.size(), begin + LEVEL_BLOCK_SIZE)};
 
-	for (const auto & entry : log) {
-		auto instruction{_parameters.route[entry.state.index]};
-		std::string description;
-		std::size_t new_indent_level{indent_level};
+			for (auto position{begin}; position < end; position++) {
+				auto [value, frames] = _cache->get(level.states[position]);
+				auto [minimum, maximum] = _get_bounds(level.states[position]);
 
-		switch (instruction.type) {
-			case InstructionType::Path:
-				description = _parameters.maps.get_map(instruction.map).description;
+				if (value >= 0 && value != BOUND_CACHE_VALUE && (minimum != maximum || _parameters.always_allow_cache)) {
+					level.frames[position] = frames;
+				} else {
+					level.status[position] = (value < 0 || value == BOUND_CACHE_VALUE) && (_checkpoints[index] || index < cache_until) ? LevelStatus::EvaluateAndCache : LevelStatus::Evaluate;
+				}
+			}
 
-				if (instruction.end_search) {
-					new_indent_level--;
+			std::vector<std::vector<State>> successors(end - begin);
+			std::vector<std::size_t> evaluations(_statistics ? end - begin : 0);
+
+			_parallel_for(end - begin, [this, &level, &successors, &evaluations, begin, route_size](std::size_t offset) {
+				auto position{begin + offset};
+
+				if (level.status[position] == LevelStatus::Resolved) {
+					return;
 				}
 
-				break;
-			case InstructionType::Choice:
-				description = entry.extra_text;
-				new_indent_level++;
-				break;
-			case InstructionType::Search:
-				description = instruction.text;
-				new_indent_level++;
-				break;
-			case InstructionType::Note:
-				description = instruction.text;
-				break;
-			case InstructionType::End:
-				new_indent_level--;
-				break;
-			case InstructionType::Data:
-			case InstructionType::Delay:
-			case InstructionType::Option:
-			case InstructionType::Party:
-			case InstructionType::Route:
-			case InstructionType::Save:
-			case InstructionType::Version:
-				break;
-		}
+				const auto & current_state{level.states[position]};
+				auto [minimum, maximum] = _get_bounds(current_state);
+				bool feasible{false};
+				PathWalk walk;
 
-		if (!description.empty()) {
-			raw_output += (boost::format("%-78sSeed: %3d   Index: %3d\n") % (boost::format("%s%s") % std::string(indent_level * 2, ' ') % description).str() % entry.state.step_seed % entry.state.step_index).str();
-		}
+				for (int i = minimum; i <= maximum || (!feasible && i <= MAXIMUM_CACHE_VALUE); i++) {
+					auto [work_state, result] = _apply(current_state, &walk, i);
 
-		if (entry.steps > 0 || instruction.optional_steps > 0) {
-			auto steps{entry.steps - instruction.required_steps};
-			auto optional_steps{std::min(instruction.optional_steps, steps)};
-			auto extra_steps{steps - optional_steps};
+					if (!evaluations.empty()) {
+						evaluations[offset]++;
+					}
 
-			if (extra_steps % 2 == 1 && optional_steps > 0) {
-				optional_steps--;
-				extra_steps++;
-			}
+					if (result < Milliframes::max()) {
+						feasible = true;
 
-			total_optional_steps += optional_steps;
-			total_extra_steps += extra_steps;
+						if (work_state.get_index() < route_size) {
+							successors[offset].push_back(work_state);
+						}
+					}
+				}
+			});
 
-			if (instruction.optional_steps > 0) {
-				raw_output += (boost::format("%sOptional Steps: %d\n") % std::string((indent_level + 1) * 2, ' ') % optional_steps).str();
+			if (_statistics) {
+				for (auto position{begin}; position < end; position++) {
+					if (level.status[position] != LevelStatus::Resolved) {
+						_statistics->states[index]++;
+						_statistics->evaluations[index] += evaluations[position - begin];
+					}
+				}
 			}
 
-			if (extra_steps > 0) {
-				raw_output += (boost::format("%sExtra Steps: %d\n") % std::string((indent_level + 1) * 2, ' ') % extra_steps).str();
+			for (const auto & block_successors : successors) {
+				for (const auto & successor : block_successors) {
+					release_index[successor.get_index()] = std::min(release_index[successor.get_index()], index);
+					discover(successor);
+				}
 			}
 		}
+	}
 
-		for (const auto & [step, encounter_index, encounter_id, frames] : entry.encounters) {
-			auto encounter{_parameters.encounters.get_encounter(static_cast<std::size_t>(encounter_id))};
-			if (step > entry.steps) {
-				raw_output += (boost::format("%s(Step %3d: %d / %s)\n") % std::string((indent_level + 1) * 2 - 1, ' ') % step % (encounter_index + 1) % encounter->get_description()).str();
-			} else {
-				raw_output += (boost::format("%sStep %3d: %d / %s (%0.3fs)\n") % std::string((indent_level + 1) * 2, ' ') % step % (encounter_index + 1) % encounter->get_description() % Seconds(frames).count()).str();
-				encounter_frames += frames;
-				total_encounters++;
-			}
-		}
+	std::vector<std::vector<std::size_t>> releases(route_size);
 
-		total_frames += entry.frames;
-		indent_level = new_indent_level;
+	for (auto index{start_index + 1}; index < route_size; index++) {
+		if (release_index[index] < route_size) {
+			releases[release_index[index]].push_back(index);
+		}
 	}
 
-	std::string output;
+	for (auto index{route_size}; index-- > start_index;) {
+		auto & level{levels[index]};
 
-	output += (boost::format("ROUTE\t%s\n") % _route_title).str();
-	output += (boost::format("VERSION\t%d\n") % _route_version).str();
-	output += (boost::format("ROSA\t%s\n") % ROSA_VERSION).str();
-	output += (boost::format("SEED\t%d\n") % state.step_seed).str();
-	output += (boost::format("MAXSTEP\t%d\n") % _parameters.maximum_extra_steps).str();
-	output += (boost::format("MAXSEG\t%d\n") % _parameters.maximum_step_segments).str();
-	output += (boost::format("TASMODE\t%d\n") % (_parameters.tas_mode ? 1 : 0)).str();
-	output += (boost::format("MINIMUM\t%d\n") % (_parameters.maximum_step_segments >= 0 && _parameters.prefer_fewer_locations ? 1 : 0)).str();
-	output += (boost::format("FRAMES\t%d\n") % total_frames.count()).str();
+		for (std::size_t begin{0}; begin < level.states.size(); begin += LEVEL_BLOCK_SIZE) {
+			_cache->poll();
 
-	std::set<int> keys;
+			auto end{std::min(level.states.size(), begin + LEVEL_BLOCK_SIZE)};
+			std::vector<int> values(end - begin, -1);
 
-	for (const auto & [key, value] : _variables) {
-		keys.insert(key);
-	}
+			_parallel_for(end - begin, [this, &levels, &level, &values, begin, route_size](std::size_t offset) {
+				auto position{begin + offset};
 
-	std::string variable_output;
+				if (level.status[position] == LevelStatus::Resolved) {
+					return;
+				}
 
-	for (const auto & key : keys) {
-		if (_variables[key].value > 0) {
-			variable_output += (variable_output.empty() ? "" : " ") + (boost::format("%07X:%d") % key % _variables[key].value).str();
-		}
-	}
+				const auto & current_state{level.states[position]};
+				auto [minimum, maximum] = _get_bounds(current_state);
 
-	output += (boost::format("VARS\t%s\n\n") % variable_output).str();
-	output += raw_output + '\n';
-	output += (boost::format("%-21s%0.3fs\n") % "Encounter Time:" % Seconds(encounter_frames).count()).str();
-	output += (boost::format("%-21s%0.3fs\n") % "Other Time:" % Seconds(total_frames - encounter_frames).count()).str();
-	output += (boost::format("%-21s%0.3fs\n\n") % "Total Time:" % Seconds(total_frames).count()).str();
+				int value{-1};
+				Milliframes frames{Milliframes::max()};
+				bool feasible{false};
+				PathWalk walk;
 
-	Engine base_engine{Parameters{_parameters.route, _parameters.encounters, _parameters.maps, 0, _parameters.tas_mode, false, true, -1, CacheType::Dynamic, ""}};
-	auto base_frames{base_engine._optimize(state)};
-	auto base_log{base_engine._finalize(state)};
+				// Tries the same decisions as the expand pass, so that every
+				// successor looked up here was discovered there.
+				for (int i = minimum; i <= maximum || (!feasible && i <= MAXIMUM_CACHE_VALUE); i++) {
+					auto [work_state, result] = _apply(current_state, &walk, i);
 
-	output += (boost::format("%-21s%0.3fs\n") % "Base Total Time:" % Seconds(base_frames).count()).str();
-	output += (boost::format("%-21s%0.3fs\n\n") % "Time Saved:" % Seconds(base_frames - total_frames).count()).str();
+					if (result < Milliframes::max()) {
+						feasible = true;
 
-	output += (boost::format("%-21s%d\n") % "Optional Steps:" % total_optional_steps).str();
-	output += (boost::format("%-21s%d\n") % "Extra Steps:" % total_extra_steps).str();
-	output += (boost::format("%-21s%d\n\n") % "Encounters:" % total_encounters).str();
+						if (work_state.get_index() < route_size) {
+							const auto & next_level{levels[work_state.get_index()]};
+							result += next_level.frames[next_level.get_position(work_state)];
+						}
+					}
 
-	auto base_encounters{std::accumulate(base_log.begin(), base_log.end(), 0, [](const auto a, const auto & entry) {
-		int encounters{0};
+					if (result < frames) {
+						value = i;
+						frames = result;
+					}
+				}
 
-		for (const auto & [step, encounter_index, encounter_id, frames] : entry.encounters) {
-			if (step <= entry.steps) {
-				encounters++;
+				// As in _optimize(), a state with no route to the end is cached
+				// as a bound, since it has no decision.
+				level.frames[position] = frames;
+				values[offset] = value < 0 ? BOUND_CACHE_VALUE : value;
+			});
+
+			for (auto position{begin}; position < end; position++) {
+				if (level.status[position] == LevelStatus::EvaluateAndCache) {
+					_cache->set(level.states[position], values[position - begin], level.frames[position]);
+				}
 			}
 		}
 
-		return a + encounters;
-	})};
-
-	output += (boost::format("%-21s%d\n") % "Base Encounters:" % base_encounters).str();
-	output += (boost::format("%-21s%d\n\n") % "Encounters Saved:" % (base_encounters - total_encounters)).str();
+		for (std::size_t i{0}; i < states.size(); i++) {
+			if (states[i].get_index() == index) {
+				results[i] = level.frames[level.get_position(states[i])];
+			}
+		}
 
-	output += (boost::format("%-21s%d\n") % "Number of Variables:" % _variables.size()).str();
+		for (const auto & next_index : releases[index]) {
+			levels[next_index] = Level{};
+		}
+	}
 
-	return output;
+	return results;
 }
 
-auto Engine::_optimize(const State & state) -> Milliframes {
-	if (state.index == _parameters.route.size()) {
-		return 0_mf;
+void Engine::_parallel_for(std::size_t count, const std::function<void(std::size_t)> & function) {
+	if (_pool) {
+		_pool->parallel_for(count, function);
+	} else {
+		for (std::size_t i{0}; i < count; i++) {
+			function(i);
+		}
 	}
+}
 
-	auto [value, frames] = _cache->get(state);
-	bool update_cache{value < 0};
-
-	auto instruction{_parameters.route[state.index]};
+auto Engine::_get_bounds(const State & state) const -> std::pair<int, int> {
+	const auto & instruction{_instructions[state.get_index()]};
 
 	int minimum{0};
 	int maximum{0};
@@ -315,71 +1536,92 @@ auto Engine::_optimize(const State & state) -> Milliframes {
 		maximum = _variables.at(instruction.variable).maximum;
 	}
 
-	if (instruction.type == InstructionType::Path && state.remaining_segments == 0) {
+	if (instruction.type == InstructionType::Path && state.get_remaining_segments() == 0) {
 		maximum = minimum;
 	}
 
-	if (value >= 0 && (minimum != maximum || _parameters.always_allow_cache)) {
-		return frames;
+	return std::make_pair(minimum, maximum);
+}
+
+auto Engine::_get_work_state(const State & state, int value) const -> State {
+	State work_state{state};
+
+	if (_instructions[state.get_index()].type == InstructionType::Path && value > 0 && _parameters.maximum_step_segments >= 0 && work_state.get_remaining_segments() > 0) {
+		work_state.set_remaining_segments(static_cast<uint16_t>(work_state.get_remaining_segments() - 1));
 	}
 
-	value = -1;
-	frames = Milliframes::max();
+	return work_state;
+}
 
-	for (int i = minimum; i <= maximum || frames == Milliframes::max(); i++) {
-		State work_state{state};
+// Applies a decision to a state, as _cycle() does without a log, and then any
+// fixed instructions that follow it, so the resulting state is at the next
+// decision. For a PATH, the walk holds the segment as walked for the previous
+// decision, and is only extended by the steps this decision adds, rather than
+// walking the segment again from the start. The steps never decrease as the
+// decision increases, so decisions must be applied in increasing order with
+// the same walk.
+auto Engine::_apply(const State & state, PathWalk * walk, int value) -> std::pair<State, Milliframes> {
+	auto [work_state, frames] = _apply_decision(state, walk, value);
+
+	if (frames < Milliframes::max()) {
+		auto fixed_frames{_skip_fixed(&work_state)};
+		frames = fixed_frames == Milliframes::max() ? fixed_frames : frames + fixed_frames;
+	}
 
-		if (instruction.type == InstructionType::Path && i > 0 && _parameters.maximum_step_segments >= 0 && work_state.remaining_segments > 0) {
-			work_state.remaining_segments--;
-		}
+	return std::make_pair(work_state, frames);
+}
 
-		auto result{_cycle(&work_state, nullptr, i)};
+auto Engine::_apply_decision(const State & state, PathWalk * walk, int value) -> std::pair<State, Milliframes> {
+	auto index{state.get_index()};
+	const auto & instruction{_instructions[index]};
 
-		if (result < Milliframes::max()) {
-			result += _optimize(work_state);
-		}
+	if (instruction.type != InstructionType::Path) {
+		State work_state{_get_work_state(state, value)};
+		auto frames{_cycle(&work_state, nullptr, value)};
 
-		if (result < frames) {
-			value = i;
-			frames = result;
-		}
+		return std::make_pair(work_state, frames);
 	}
 
-	if (update_cache) {
-		_cache->set(state, value, frames);
+	if (!walk->started) {
+		walk->state = state;
+		walk->state.set_segment_encounters(false);
+		walk->frames = instruction.transition_count * FRAMES_PER_TRANSITION;
+		walk->frames += _step(&walk->state, nullptr, instruction.tiles, instruction.required_steps);
+		walk->started = true;
 	}
 
-	return frames;
-}
+	const auto [tiles, steps] = get_extra_steps(instruction, value);
 
-auto Engine::_cycle(State * state, LogEntry * log, int value) -> Milliframes {
-	Milliframes frames{0};
-	const auto & instruction{_parameters.route[state->index]};
+	walk->frames += _step(&walk->state, nullptr, 0, steps - walk->steps);
+	walk->steps = steps;
 
-	switch (instruction.type) {
-		case InstructionType::Choice:
-			while (value >= 0) {
-				state->index++;
+	State work_state{_get_work_state(walk->state, value)};
+
+	if (instruction.end_search) {
+		if (work_state.is_search_active() && !work_state.is_search_complete()) {
+			return std::make_pair(work_state, Milliframes::max());
+		}
 
-				int level{0};
+		work_state.end_search();
+	}
 
-				while (level > 0 || _parameters.route[state->index].type != InstructionType::Option) {
-					if (_parameters.route[state->index].type == InstructionType::Choice) {
-						level++;
-					} else if (_parameters.route[state->index].type == InstructionType::End) {
-						level--;
-					}
+	work_state.set_index(index + 1);
 
-					state->index++;
-				}
+	return std::make_pair(work_state, walk->frames + tiles * FRAMES_PER_TILE);
+}
 
-				value--;
-			}
+auto Engine::_cycle(State * state, LogEntry * log, int value) -> Milliframes {
+	Milliframes frames{0};
+	auto index{state->get_index()};
+	const auto & instruction{_instructions[index]};
 
+	switch (instruction.type) {
+		case InstructionType::Choice:
+			index = _options[instruction.target + static_cast<std::size_t>(value)];
 			frames += instruction.transition_count * FRAMES_PER_TRANSITION;
 
 			if (log != nullptr) {
-				log->extra_text = _parameters.route[state->index].text;
+				log->extra_text = _parameters.route[index].text;
 			}
 
 			break;
@@ -389,53 +1631,25 @@ auto Engine::_cycle(State * state, LogEntry * log, int value) -> Milliframes {
 		case InstructionType::End:
 		case InstructionType::Note:
 			break;
-		case InstructionType::Option: {
-			int level{0};
-
-			while (level > 0 || _parameters.route[state->index + 1].type != InstructionType::End) {
-				if (_parameters.route[state->index + 1].type == InstructionType::Choice) {
-					level++;
-				} else if (_parameters.route[state->index + 1].type == InstructionType::End) {
-					level--;
-				}
-
-				state->index++;
-			}
-
+		case InstructionType::Option:
+			// Continue from the END, which completes the CHOICE.
+			index = instruction.target - 1;
 			break;
-		}
 		case InstructionType::Party:
-			state->party = Party{instruction.text};
+			state->set_party(_parties, instruction.party);
 			break;
 		case InstructionType::Path: {
-			state->segment_encounters = 0;
+			state->set_segment_encounters(false);
 
 			frames += instruction.transition_count * FRAMES_PER_TRANSITION;
 			frames += _step(state, log, instruction.tiles, instruction.required_steps);
 
 			if (value > 0) {
-				int optional_steps{std::min(instruction.optional_steps, value)};
-				int extra_steps{value - optional_steps};
-
-				if (extra_steps % 2 == 1 && optional_steps > 0) {
-					extra_steps++;
-					optional_steps--;
-				}
-
-				if (extra_steps % 2 == 1 && !instruction.can_single_step) {
-					extra_steps--;
-				}
-
-				int tiles{instruction.can_double_step ? extra_steps : extra_steps * 2};
-
-				if (tiles % 2 == 1) {
-					tiles++;
-				}
-
-				frames += _step(state, log, tiles, optional_steps + extra_steps);
+				const auto [tiles, steps] = get_extra_steps(instruction, value);
+				frames += _step(state, log, tiles, steps);
 			}
 
-			if ((log != nullptr) && state->search_active) {
+			if ((log != nullptr) && state->is_search_active()) {
 				int extra_steps{UINT8_MAX + 1 - instruction.required_steps - value};
 
 				if (extra_steps > 0) {
@@ -446,18 +1660,16 @@ auto Engine::_cycle(State * state, LogEntry * log, int value) -> Milliframes {
 			}
 
 			if (instruction.end_search) {
-				if (state->search_active && !state->search_complete) {
+				if (state->is_search_active() && !state->is_search_complete()) {
 					return Milliframes::max();
 				}
 
-				state->search_party = Party{""};
-				state->search_active = false;
+				state->end_search();
 			}
 
 			break;
 		}
 		case InstructionType::Route:
-			_route_title = instruction.text;
 			break;
 		case InstructionType::Save:
 			// TODO(jason@calindora.com): This needs to be implemented, but it
@@ -465,27 +1677,15 @@ auto Engine::_cycle(State * state, LogEntry * log, int value) -> Milliframes {
 			// number in the instruction.
 			break;
 		case InstructionType::Search:
-			state->search_targets.clear();
+			state->start_search(static_cast<uint16_t>(index));
 
-			for (const auto & encounter_id : instruction.numbers) {
-				state->search_targets.push_back(static_cast<std::size_t>(encounter_id));
-			}
-
-			state->search_expression = instruction.expression;
-			state->search_values.fill(false);
-			state->search_party = Party{instruction.party};
-			state->search_active = true;
-			state->search_complete = false;
-
-			break;
-		case InstructionType::Version:
-			_route_version = instruction.number;
 			break;
 		case InstructionType::Data:
+		case InstructionType::Version:
 			break;
 	}
 
-	state->index++;
+	state->set_index(index + 1);
 
 	if (log != nullptr) {
 		log->frames = frames;
@@ -495,78 +1695,53 @@ auto Engine::_cycle(State * state, LogEntry * log, int value) -> Milliframes {
 }
 
 auto Engine::_step(State * state, LogEntry * log, int tiles, int steps) -> Milliframes {
-	const auto & instruction{_parameters.route[state->index]};
-	const auto & map{_parameters.maps.get_map(instruction.map)};
+	const auto & instruction{_instructions[state->get_index()]};
+	const auto & step_table{*instruction.step_table};
 
 	Milliframes frames{tiles * FRAMES_PER_TILE};
 
-	for (auto i{0}; i < steps; i++) {
-		state->step_index = (state->step_index + 1) % (UINT8_MAX + 1);
-
-		if (state->step_index == 0) {
-			state->step_seed = (state->step_seed + SEED_UPDATE_DELTA) % (UINT8_MAX + 1);
-		}
-
-		if ((_rng_data[static_cast<std::size_t>(state->step_index)] + state->step_seed) % (UINT8_MAX + 1) < map.encounter_rate) {
-			auto encounter_rng{(_rng_data[static_cast<std::size_t>(state->encounter_index)] + state->encounter_seed) % (UINT8_MAX + 1)};
-			std::size_t encounter_group_index{7}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-
-			if (encounter_rng < 43) { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-				encounter_group_index = 0;
-			} else if (encounter_rng < 86) { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-				encounter_group_index = 1;
-			} else if (encounter_rng < 129) { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-				encounter_group_index = 2;
-			} else if (encounter_rng < 172) { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-				encounter_group_index = 3;
-			} else if (encounter_rng < 204) { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-				encounter_group_index = 4;
-			} else if (encounter_rng < 236) { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-				encounter_group_index = 5; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-			} else if (encounter_rng < 252) { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-				encounter_group_index = 6; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-			}
+	for (auto remaining_steps{steps}; remaining_steps > 0;) {
+		auto step_position{state->get_step_position()};
+		auto encounter_steps{step_table.get_next_encounter(step_position, remaining_steps)};
 
-			auto encounter{_parameters.encounters.get_encounter_from_group(static_cast<std::size_t>(map.encounter_group), encounter_group_index)};
-			auto encounter_id{encounter->get_id()};
-			auto encounter_frames{encounter->get_duration(state->party, _parameters.tas_mode)};
+		if (encounter_steps < 0) {
+			state->set_step_position(static_cast<uint16_t>(step_position + remaining_steps));
+			break;
+		}
 
-			if (state->segment_encounters == 0) {
-				encounter_frames += instruction.first_battle_penalty;
-			}
+		state->set_step_position(static_cast<uint16_t>(step_position + encounter_steps));
+		remaining_steps -= encounter_steps;
 
-			state->segment_encounters++;
+		auto encounter_id{_encounter_table->get_encounter_id(instruction.encounter_group, state->get_encounter_seed(), state->get_encounter_index())};
+		auto encounter_frames{_encounter_table->get_duration(encounter_id, state->get_party())};
 
-			frames += encounter_frames;
+		if (!state->has_segment_encounters()) {
+			encounter_frames += instruction.first_battle_penalty;
+		}
 
-			if (log != nullptr) {
-				auto encounter_step{state->step_index - log->state.step_index};
-				auto step_seed_delta{state->step_seed - log->state.step_seed};
+		state->set_segment_encounters(true);
 
-				if (step_seed_delta > 0) {
-					encounter_step += (step_seed_delta / SEED_UPDATE_DELTA) * (UINT8_MAX + 1);
-				} else if (step_seed_delta < 0) {
-					encounter_step += ((step_seed_delta + (UINT8_MAX + 1)) / SEED_UPDATE_DELTA) * (UINT8_MAX + 1);
-				}
+		frames += encounter_frames;
 
-				log->encounters.emplace_back(std::make_tuple(encounter_step, state->encounter_index, encounter_id, encounter_frames));
-			}
+		if (log != nullptr) {
+			auto encounter_step{static_cast<uint16_t>(state->get_step_position() - log->state.get_step_position())};
 
-			if (state->search_active && !state->search_complete) {
-				_assign_search_encounter(state, encounter_id, *state->search_expression);
+			log->encounters.emplace_back(std::make_tuple(encounter_step, state->get_encounter_index(), encounter_id, encounter_frames));
+		}
 
-				if (_check_search_complete(state, *state->search_expression)) {
-					state->party = state->search_party;
-					state->search_complete = true;
-				}
-			}
+		if (state->is_search_active() && !state->is_search_complete()) {
+			const auto & search_instruction{_instructions[state->get_search()]};
+			const auto [search_values, search_complete] = search_instruction.search->advance(state->get_search_values(), encounter_id);
 
-			state->encounter_index = (state->encounter_index + 1) % (UINT8_MAX + 1);
+			state->set_search_values(search_values);
 
-			if (state->encounter_index == 0) {
-				state->encounter_seed = (state->encounter_seed + SEED_UPDATE_DELTA) % (UINT8_MAX + 1);
+			if (search_complete) {
+				state->set_party(_parties, search_instruction.party);
+				state->complete_search();
 			}
 		}
+
+		state->advance_encounter();
 	}
 
 	if (log != nullptr) {
@@ -575,68 +1750,3 @@ auto Engine::_step(State * state, LogEntry * log, int tiles, int steps) -> Milli
 
 	return frames;
 }
-
-auto Engine::_check_search_complete(State * state, const peg::Ast & expression) -> bool {
-	using peg::udl::operator""_;
-
-	switch (expression.tag) {
-		case "disjunction"_:
-			return std::any_of(expression.nodes.begin(), expression.nodes.end(), [state](const auto & node){ return _check_search_complete(state, *node); });
-		case "conjunction"_:
-		case "sequence"_:
-			return std::all_of(expression.nodes.begin(), expression.nodes.end(), [state](const auto & node){ return _check_search_complete(state, *node); });
-		case "number"_:
-			return state->search_values.at(expression.token_to_number<std::size_t>());
-		default:
-			std::cerr << "BUG: Unimplemented tag in _check_search_complete. Please report this." << std::endl;
-			break;
-	}
-
-	return false;
-}
-
-auto Engine::_assign_search_encounter(State * state, std::size_t encounter_id, const peg::Ast & expression) -> bool {
-	using peg::udl::operator""_;
-
-	switch (expression.tag) {
-		case "conjunction"_:
-			for (const auto & node : expression.nodes) {
-				if (!_check_search_complete(state, *node)) {
-					if (_assign_search_encounter(state, encounter_id, *node)) {
-						return true;
-					}
-				}
-			}
-
-			break;
-		case "disjunction"_:
-			for (const auto & node : expression.nodes) {
-				_assign_search_encounter(state, encounter_id, *node);
-			}
-
-			break;
-		case "number"_: {
-			auto number = expression.token_to_number<std::size_t>();
-
-			if (!state->search_values.at(number) && state->search_targets.at(number) == encounter_id) {
-				state->search_values.at(number) = true;
-				return true;
-			}
-
-			break;
-		}
-		case "sequence"_:
-			for (const auto & node: expression.nodes) {
-				if (!_check_search_complete(state, *node)) {
-					return _assign_search_encounter(state, encounter_id, *node);
-				}
-			}
-
-			break;
-		default:
-			std::cerr << "BUG: Unimplemented tag in _assign_search_encounter. Please report this." << std::endl;
-			break;
-	}
-
-	return false;
-}
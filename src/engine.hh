@@ -7,8 +7,14 @@
 #include "instruction.hh"
 #include "map.hh"
 #include "parameters.hh"
+#include "rng.hh"
 #include "state.hh"
+#include "thread_pool.hh"
 
+#include <boost/functional/hash.hpp>
+#include <tsl/sparse_map.h>
+
+#include <optional>
 #include <vector>
 
 struct LogEntry {
@@ -24,7 +30,90 @@ struct LogEntry {
 
 using Log = std::vector<LogEntry>;
 
+// The routes for a pair of twin seeds resolved together, with the frames of
+// each, and of each seed's route when solved on its own.
+struct TwinRoutes {
+	std::vector<std::string> outputs{};
+	std::vector<Milliframes> frames{};
+	std::vector<Milliframes> independent_frames{};
+};
+
+using TwinKey = std::pair<std::tuple<uint64_t, uint64_t, uint64_t>, std::tuple<uint64_t, uint64_t, uint64_t>>;
+
+// A PATH segment as walked so far while its decisions are being evaluated.
+struct PathWalk {
+	State state{};
+	Milliframes frames{0};
+
+	int steps{0};
+	bool started{false};
+};
+
+// The fields of a route instruction that are read while optimizing, with the
+// step table, encounter group, party and search it refers to already resolved.
+// These are kept in one compact array apart from the route, so that the hot
+// paths never touch its text.
+struct CompiledInstruction {
+	const StepTable * step_table{nullptr};
+	const SearchAutomaton * search{nullptr};
+	Milliframes first_battle_penalty{0};
+
+	int variable{-1};
+	int number{0};
+	int tiles{0};
+	int required_steps{0};
+	int optional_steps{0};
+	int transition_count{0};
+
+	// For a CHOICE, the position of the index of its first OPTION in the
+	// option table. For an OPTION, the index of the END of its CHOICE.
+	uint32_t target{0};
+
+	uint16_t encounter_group{0};
+	uint16_t party{0};
+
+	InstructionType type{InstructionType::Note};
+	bool can_single_step{false};
+	bool can_double_step{false};
+	bool end_search{false};
+};
+
+// What the engine has done so far, kept only when statistics are enabled. States
+// are those expanded, and evaluations the values applied to them, at each route
+// index. The base engine is only timed, as its own work is not of interest.
+struct EngineStatistics {
+	std::vector<std::size_t> states{};
+	std::vector<std::size_t> evaluations{};
+
+	Seconds solve_time{0};
+	Seconds finalize_time{0};
+	Seconds base_time{0};
+};
+
+enum class LevelStatus : uint8_t {
+	Resolved,
+	Evaluate,
+	EvaluateAndCache
+};
+
+struct Level {
+	std::vector<State> states{};
+	std::vector<Milliframes> frames{};
+	std::vector<LevelStatus> status{};
+
+	tsl::sparse_map<std::tuple<uint64_t, uint64_t, uint64_t>, std::size_t, boost::hash<std::tuple<uint64_t, uint64_t, uint64_t>>> positions{};
+	bool sealed{false};
+
+	// Sorts the states by key and releases the positions, once no more states
+	// will be discovered, after which states are found by binary search.
+	void seal();
+
+	[[nodiscard]] auto get_position(const State & state) const -> std::size_t;
+};
+
 class Engine {
+	friend class Benchmark;
+
 	public:
 		explicit Engine(Parameters parameters);
 
@@ -32,45 +121,73 @@ class Engine {
 		void set_variable_maximum(int variable, int value);
 
 		auto optimize(int seed) -> std::string;
+		auto optimize(const std::vector<int> & seeds) -> std::vector<std::string>;
+
+		auto replay(int seed, const std::vector<std::pair<int, int>> & values) -> std::optional<std::string>;
+		auto optimize_twins(int seed, int twin_seed, std::size_t shared_until) -> TwinRoutes;
+
+		auto estimate_cost(int seed) -> std::size_t;
+
+		void check_encounter_data() const;
+
+		[[nodiscard]] auto get_statistics_report(std::size_t lines) const -> std::string;
 
 	private:
-		auto _optimize(const State & state) -> Milliframes;
+		auto _get_base_engine() -> Engine &;
+		auto _get_initial_state(int seed) const -> State;
+		auto _get_route_fingerprints() const -> std::vector<uint64_t>;
+		auto _get_cache_signature() const -> uint64_t;
+		auto _get_suffix_bounds() const -> std::vector<Milliframes>;
+		auto _solve(const std::vector<State> & states) -> std::vector<Milliframes>;
+		auto _optimize(const State & state, Milliframes limit = Milliframes::max()) -> Milliframes;
+		auto _optimize_iterative(const std::vector<State> & states, std::size_t cache_until = 0) -> std::vector<Milliframes>;
+		auto _optimize_twins(const State & first, const State & second) -> Milliframes;
+		auto _cycle_twins(const State & first, const State & second, int value) -> std::tuple<State, State, Milliframes, bool>;
+		auto _finish_twin(State state) -> Milliframes;
+		void _parallel_for(std::size_t count, const std::function<void(std::size_t)> & function);
+		auto _get_bounds(const State & state) const -> std::pair<int, int>;
+		auto _get_work_state(const State & state, int value) const -> State;
 		auto _finalize(State state) -> Log;
+		auto _record(State * state, Log * log, int value) -> Milliframes;
+		auto _describe(const LogEntry & entry) const -> std::pair<std::string, int>;
+		auto _get_base_result(const State & state) -> std::pair<Milliframes, int>;
+		auto _get_variable_values() const -> std::vector<std::pair<int, int>>;
+		auto _generate_output(const State & state, const Log & log) -> std::string;
 		auto _generate_output_text(const State & state, const Log & log) -> std::string;
+		auto _generate_output_json(const State & state, const Log & log) -> std::string;
 
+		void _update_decisions();
+		auto _skip_fixed(State * state) -> Milliframes;
+		auto _apply(const State & state, PathWalk * walk, int value) -> std::pair<State, Milliframes>;
+		auto _apply_decision(const State & state, PathWalk * walk, int value) -> std::pair<State, Milliframes>;
 		auto _cycle(State * state, LogEntry * log, int value) -> Milliframes;
 		auto _step(State * state, LogEntry * log, int tiles, int steps) -> Milliframes;
 
-		static auto _check_search_complete(State * state, const peg::Ast & expression) -> bool;
-		static auto _assign_search_encounter(State * state, std::size_t encounter_id, const peg::Ast & expression) -> bool;
-
 		const Parameters _parameters;
 
 		Variables _variables;
 
 		std::unique_ptr<Cache> _cache;
+		std::unique_ptr<ThreadPool> _pool;
 
 		std::string _route_title;
 		int _route_version{0};
 
-		const std::vector<int> _rng_data{
-			0x07, 0xB6, 0xF0, 0x1F, 0x55, 0x5B, 0x37, 0xE3, 0xAE, 0x4F, 0xB2, 0x5E, 0x99, 0xF6, 0x77, 0xCB,
-			0x60, 0x8F, 0x43, 0x3E, 0xA7, 0x4C, 0x2D, 0x88, 0xC7, 0x68, 0xD7, 0xD1, 0xC2, 0xF2, 0xC1, 0xDD,
-			0xAA, 0x93, 0x16, 0xF7, 0x26, 0x04, 0x36, 0xA1, 0x46, 0x4E, 0x56, 0xBE, 0x6C, 0x6E, 0x80, 0xD5,
-			0xB5, 0x8E, 0xA4, 0x9E, 0xE7, 0xCA, 0xCE, 0x21, 0xFF, 0x0F, 0xD4, 0x8C, 0xE6, 0xD3, 0x98, 0x47,
-			0xF4, 0x0D, 0x15, 0xED, 0xC4, 0xE4, 0x35, 0x78, 0xBA, 0xDA, 0x27, 0x61, 0xAB, 0xB9, 0xC3, 0x7D,
-			0x85, 0xFC, 0x95, 0x6B, 0x30, 0xAD, 0x86, 0x00, 0x8D, 0xCD, 0x7E, 0x9F, 0xE5, 0xEF, 0xDB, 0x59,
-			0xEB, 0x05, 0x14, 0xC9, 0x24, 0x2C, 0xA0, 0x3C, 0x44, 0x69, 0x40, 0x71, 0x64, 0x3A, 0x74, 0x7C,
-			0x84, 0x13, 0x94, 0x9C, 0x96, 0xAC, 0xB4, 0xBC, 0x03, 0xDE, 0x54, 0xDC, 0xC5, 0xD8, 0x0C, 0xB7,
-			0x25, 0x0B, 0x01, 0x1C, 0x23, 0x2B, 0x33, 0x3B, 0x97, 0x1B, 0x62, 0x2F, 0xB0, 0xE0, 0x73, 0xCC,
-			0x02, 0x4A, 0xFE, 0x9B, 0xA3, 0x6D, 0x19, 0x38, 0x75, 0xBD, 0x66, 0x87, 0x3F, 0xAF, 0xF3, 0xFB,
-			0x83, 0x0A, 0x12, 0x1A, 0x22, 0x53, 0x90, 0xCF, 0x7A, 0x8B, 0x52, 0x5A, 0x49, 0x6A, 0x72, 0x28,
-			0x58, 0x8A, 0xBF, 0x0E, 0x06, 0xA2, 0xFD, 0xFA, 0x41, 0x65, 0xD2, 0x4D, 0xE2, 0x5C, 0x1D, 0x45,
-			0x1E, 0x09, 0x11, 0xB3, 0x5F, 0x29, 0x79, 0x39, 0x2E, 0x2A, 0x51, 0xD9, 0x5D, 0xA6, 0xEA, 0x31,
-			0x81, 0x89, 0x10, 0x67, 0xF5, 0xA9, 0x42, 0x82, 0x70, 0x9D, 0x92, 0x57, 0xE1, 0x3D, 0xF1, 0xF9,
-			0xEE, 0x08, 0x91, 0x18, 0x20, 0xB1, 0xA5, 0xBB, 0xC6, 0x48, 0x50, 0x9A, 0xD6, 0x7F, 0x7B, 0xE9,
-			0x76, 0xDF, 0x32, 0x6F, 0x34, 0xA8, 0xD0, 0xB8, 0x63, 0xC8, 0xC0, 0xEC, 0x4B, 0xE8, 0x17, 0xF8
-		};
+		std::vector<std::unique_ptr<const StepTable>> _step_tables;
+
+		Parties _parties;
+		std::vector<CompiledInstruction> _instructions;
+		std::vector<std::size_t> _options;
+		std::unique_ptr<const EncounterTable> _encounter_table;
+		std::vector<Milliframes> _suffix_bounds;
+		std::vector<bool> _decisions;
+		std::vector<bool> _checkpoints;
+
+		tsl::sparse_map<TwinKey, std::pair<int, Milliframes>, boost::hash<TwinKey>> _twin_cache;
+		std::size_t _twin_shared_until{0};
+
+		std::unique_ptr<Engine> _base_engine;
+		std::unique_ptr<EngineStatistics> _statistics;
 };
 
 #endif // ROSA_ENGINE_HH
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <locale>
+#include <string>
 #include <vector>
 
 #include <boost/algorithm/string.hpp>
@@ -21,8 +22,19 @@ static auto parse_variable(const std::string & s) -> int {
 	}
 }
 
+// The 64-bit FNV-1a hash, continuing from a previous hash if one is given.
+static auto hash_text(const std::string & text, uint64_t hash = 0xCBF29CE484222325ULL) -> uint64_t { // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+	const uint64_t prime{0x100000001B3ULL};
+
+	for (const auto & c : text) {
+		hash = (hash ^ static_cast<unsigned char>(c)) * prime;
+	}
+
+	return hash;
+}
+
 Instruction::Instruction(const std::string & line) :
-		expression_string(std::make_shared<std::string>()) {
+		source(line), expression_string(std::make_shared<std::string>()), fingerprint(hash_text(line)) {
 	std::vector<std::string> tokens;
 	boost::algorithm::split(tokens, line, boost::is_any_of("\t"), boost::token_compress_on);
 
@@ -84,7 +96,7 @@ Instruction::Instruction(const std::string & line) :
 					} else {
 						if (current_number.length() > 0) {
 							numbers.push_back(std::stoi(current_number));
-							expression_string->push_back('0' + current_index);
+							expression_string->append(std::to_string(current_index));
 
 							current_number = "";
 							current_index++;
@@ -96,7 +108,7 @@ Instruction::Instruction(const std::string & line) :
 
 				if (current_number.length() > 0) {
 					numbers.push_back(std::stoi(current_number));
-					expression_string->push_back('0' + current_index);
+					expression_string->append(std::to_string(current_index));
 				}
 
 				peg::parser parser(R"(
@@ -110,10 +122,13 @@ Instruction::Instruction(const std::string & line) :
 
 				parser.enable_ast();
 
+				std::shared_ptr<peg::Ast> expression;
+
 				if (parser.parse(*expression_string, expression)) {
-					expression = parser.optimize_ast(expression);
+					search = std::make_shared<const SearchAutomaton>(parser.optimize_ast(expression), numbers);
 				} else {
-					std::cerr << "WARNING: Invalid expression in search: " << expression_string << std::endl;
+					std::cerr << "WARNING: Invalid expression in search: " << *expression_string << std::endl;
+					search = std::make_shared<const SearchAutomaton>();
 				}
 
 				party = tokens[3];
@@ -143,11 +158,42 @@ auto read_route(std::istream & input) -> Route {
 
 			if (tokens[0] == "WAIT") {
 				route[route.size() - 1].end_search = true;
+				route[route.size() - 1].fingerprint = hash_text(line, route[route.size() - 1].fingerprint);
 			} else {
 				route.emplace_back(line);
 			}
 		}
 	}
 
+	// Link each CHOICE to its OPTIONs and each OPTION to the END of its CHOICE,
+	// so that they can be jumped to directly.
+	std::vector<std::size_t> choices;
+
+	for (std::size_t index{0}; index < route.size(); index++) {
+		if (route[index].type == InstructionType::Choice) {
+			choices.push_back(index);
+		} else if (route[index].type == InstructionType::Option) {
+			if (choices.empty()) {
+				std::cerr << "WARNING: OPTION outside of any CHOICE: " << route[index].text << std::endl;
+			} else {
+				route[choices.back()].targets.push_back(index);
+			}
+		} else if (route[index].type == InstructionType::End) {
+			if (choices.empty()) {
+				std::cerr << "WARNING: END without a matching CHOICE" << std::endl;
+			} else {
+				for (const auto & option : route[choices.back()].targets) {
+					route[option].targets.push_back(index);
+				}
+
+				choices.pop_back();
+			}
+		}
+	}
+
+	if (!choices.empty()) {
+		std::cerr << "WARNING: CHOICE without a matching END" << std::endl;
+	}
+
 	return route;
 }
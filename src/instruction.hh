@@ -1,16 +1,16 @@
 #ifndef ROSA_INSTRUCTION_HH
 #define ROSA_INSTRUCTION_HH
 
+#include <cstdint>
 #include <istream>
 #include <memory>
 #include <set>
 #include <vector>
 
-#include "peglib.h"
-
 #include "duration.hh"
+#include "search.hh"
 
-enum class InstructionType {
+enum class InstructionType : uint8_t {
 	Choice,
 	Data,
 	Delay,
@@ -33,8 +33,11 @@ class Instruction {
 		std::string text; // NOLINT(misc-non-private-member-variables-in-classes)
 		std::string party; // NOLINT(misc-non-private-member-variables-in-classes)
 
+		// The route line that defines the instruction.
+		std::string source; // NOLINT(misc-non-private-member-variables-in-classes)
+
 		std::shared_ptr<std::string> expression_string; // NOLINT(misc-non-private-member-variables-in-classes)
-		std::shared_ptr<peg::Ast> expression; // NOLINT(misc-non-private-member-variables-in-classes)
+		std::shared_ptr<const SearchAutomaton> search; // NOLINT(misc-non-private-member-variables-in-classes)
 
 		std::vector<int> numbers; // NOLINT(misc-non-private-member-variables-in-classes)
 
@@ -58,6 +61,14 @@ class Instruction {
 		Milliframes first_battle_penalty{0}; // NOLINT(misc-non-private-member-variables-in-classes)
 
 		bool end_search = false; // NOLINT(misc-non-private-member-variables-in-classes)
+
+		// For a CHOICE, the index of each of its OPTIONs. For an OPTION, the
+		// index of the END of its CHOICE.
+		std::vector<std::size_t> targets; // NOLINT(misc-non-private-member-variables-in-classes)
+
+		// A hash of the route lines that define the instruction, which is
+		// stable between runs.
+		uint64_t fingerprint = 0; // NOLINT(misc-non-private-member-variables-in-classes)
 };
 
 using Route = std::vector<Instruction>;
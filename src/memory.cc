@@ -0,0 +1,81 @@
+#include "memory.hh"
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+// Returns the current resident set size of the process in bytes, or zero if it
+// cannot be determined.
+auto get_resident_memory() -> std::size_t {
+	std::ifstream statm{"/proc/self/statm", std::ios_base::in};
+	std::size_t total_pages{0};
+	std::size_t resident_pages{0};
+
+	if (!(statm >> total_pages >> resident_pages)) {
+		return 0;
+	}
+
+	return resident_pages * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+}
+
+// Returns the physical memory of the machine in bytes, or zero if it cannot be
+// determined.
+auto get_physical_memory() -> std::size_t {
+	auto pages{sysconf(_SC_PHYS_PAGES)};
+	auto page_size{sysconf(_SC_PAGESIZE)};
+
+	if (pages <= 0 || page_size <= 0) {
+		return 0;
+	}
+
+	return static_cast<std::size_t>(pages) * static_cast<std::size_t>(page_size);
+}
+
+// Returns the peak resident set size of the process in bytes.
+auto get_peak_memory() -> std::size_t {
+	rusage usage{};
+	getrusage(RUSAGE_SELF, &usage);
+
+	return static_cast<std::size_t>(usage.ru_maxrss) * 1024; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+}
+
+// Parses a size in bytes with an optional K, M, G or T suffix (e.g. 24G). The
+// size must be at least one byte and fit in a std::size_t.
+auto parse_memory_size(const std::string & text) -> std::size_t {
+	std::size_t length{0};
+	auto value{std::stod(text, &length)};
+
+	if (!std::isfinite(value) || value <= 0) {
+		throw std::invalid_argument{"Invalid memory size: " + text};
+	}
+
+	if (length < text.length()) {
+		switch (std::toupper(text[length])) {
+			case 'T':
+				value *= 1024; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+				[[fallthrough]];
+			case 'G':
+				value *= 1024; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+				[[fallthrough]];
+			case 'M':
+				value *= 1024; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+				[[fallthrough]];
+			case 'K':
+				value *= 1024; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+				break;
+			default:
+				throw std::invalid_argument{"Invalid memory size suffix: " + text};
+		}
+	}
+
+	if (value < 1 || value >= static_cast<double>(std::numeric_limits<std::size_t>::max())) {
+		throw std::out_of_range{"Memory size out of range: " + text};
+	}
+
+	return static_cast<std::size_t>(value);
+}
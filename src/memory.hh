@@ -0,0 +1,12 @@
+#ifndef ROSA_MEMORY_HH
+#define ROSA_MEMORY_HH
+
+#include <cstddef>
+#include <string>
+
+auto get_resident_memory() -> std::size_t;
+auto get_physical_memory() -> std::size_t;
+auto get_peak_memory() -> std::size_t;
+auto parse_memory_size(const std::string & text) -> std::size_t;
+
+#endif // ROSA_MEMORY_HH
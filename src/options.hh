@@ -2,10 +2,12 @@
 #define ROSA_OPTIONS_HH
 
 #include <string>
+#include <vector>
 
 #include "cache.hh"
+#include "parameters.hh"
 
-constexpr int CACHE_DEFAULT_SIZE = 1048576;
+constexpr std::size_t PERSISTENT_CACHE_DEFAULT_SIZE = 32UL * 1024UL * 1024UL;
 
 class Options {
 	public:
@@ -17,10 +19,32 @@ class Options {
 		std::string cache_location{""};
 		std::string cache_filename{""};
 
-		std::size_t cache_size{CACHE_DEFAULT_SIZE};
+		std::string cache_size{""};
+
+		std::string snapshot{""};
+		int snapshot_interval{300}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+		SolverType solver{SolverType::Recursive};
+		int threads{1};
+		bool branch_and_bound{false};
+		bool low_memory{false};
+
+		std::string seeds{""};
+		std::string output_directory{""};
+		OutputFormat output_format{OutputFormat::Text};
+		std::string memory_limit{""};
+
+		std::vector<std::string> replay_files;
+
+		bool twins{false};
+		int twin_shared_until{0};
+
+		bool statistics{false};
+		std::size_t statistics_lines{10}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
 
 		bool tas_mode{false};
 		bool prefer_fewer_locations{false};
+		bool convert_cache{false};
 
 		int seed{0};
 		int maximum_steps{0};
@@ -9,6 +9,16 @@
 #include <memory>
 #include <unordered_map>
 
+enum class SolverType {
+	Recursive,
+	Iterative
+};
+
+enum class OutputFormat {
+	Text,
+	Json
+};
+
 struct Parameters {
 	public:
 		const Route route;
@@ -25,7 +35,21 @@ struct Parameters {
 
 		CacheType cache_type = CacheType::Dynamic;
 		std::string cache_location;
-		const std::size_t cache_size{4294967295};
+		const std::size_t cache_size{0};
+
+		const SolverType solver{SolverType::Recursive};
+		const int threads{1};
+		const bool branch_and_bound{false};
+		const bool low_memory{false};
+
+		const OutputFormat output_format{OutputFormat::Text};
+		const bool statistics{false};
+
+		const std::string snapshot_location{};
+		const Seconds snapshot_interval{0};
+
+		const std::string overflow_location{};
+		const bool overflow_for_thrashing{false};
 };
 
 #endif // ROSA_PARAMETERS_HH
@@ -62,3 +62,25 @@ auto operator<<(std::ostream & os, const Party & party) -> std::ostream & {
 	os << party._party;
 	return os;
 }
+
+Parties::Parties() {
+	add_party("");
+}
+
+auto Parties::add_party(const std::string & party) -> uint16_t {
+	const auto [iterator, inserted] = _ids.emplace(Party{party}, static_cast<uint16_t>(_parties.size()));
+
+	if (inserted) {
+		_parties.push_back(iterator->first);
+	}
+
+	return iterator->second;
+}
+
+auto Parties::get_party(uint16_t id) const -> const Party & {
+	return _parties[id];
+}
+
+auto Parties::get_size() const -> std::size_t {
+	return _parties.size();
+}
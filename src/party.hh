@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 const int HASH_MULTIPLIER = 31;
@@ -44,4 +45,21 @@ namespace std {
 	};
 } // namespace std
 
+// Assigns each distinct party in a route a small integer ID, so that states can
+// refer to parties without copying them. Parties with the same keys share an
+// ID, and the empty party always has ID zero.
+class Parties {
+	public:
+		Parties();
+
+		auto add_party(const std::string & party) -> uint16_t;
+
+		[[nodiscard]] auto get_party(uint16_t id) const -> const Party &;
+		[[nodiscard]] auto get_size() const -> std::size_t;
+
+	private:
+		std::vector<Party> _parties;
+		std::unordered_map<Party, uint16_t> _ids;
+};
+
 #endif // ROSA_PARTY_HH
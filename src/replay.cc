@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/algorithm/string/split.hpp>
+
+#include "replay.hh"
+
+// Reads a route as written by rosa. The header ends at the first empty line,
+// and the whole text is kept for comparison. Throws if a required field is
+// missing or malformed.
+auto read_stored_route(std::istream & input) -> StoredRoute {
+	StoredRoute stored;
+	std::string line;
+	bool has_seed{false};
+	bool has_frames{false};
+	bool in_header{true};
+
+	while (std::getline(input, line)) {
+		stored.text += line + '\n';
+
+		if (!in_header) {
+			continue;
+		}
+
+		if (line.empty()) {
+			in_header = false;
+			continue;
+		}
+
+		auto separator{line.find('\t')};
+		auto key{line.substr(0, separator)};
+		auto value{separator == std::string::npos ? std::string{} : line.substr(separator + 1)};
+
+		if (key == "ROUTE") {
+			stored.title = value;
+		} else if (key == "SEED") {
+			stored.seed = std::stoi(value);
+			has_seed = true;
+		} else if (key == "MAXSTEP") {
+			stored.maximum_extra_steps = std::stoi(value);
+		} else if (key == "MAXSEG") {
+			stored.maximum_step_segments = std::stoi(value);
+		} else if (key == "TASMODE") {
+			stored.tas_mode = std::stoi(value) != 0;
+		} else if (key == "MINIMUM") {
+			stored.prefer_fewer_locations = std::stoi(value) != 0;
+		} else if (key == "FRAMES") {
+			stored.frames = std::stoll(value);
+			has_frames = true;
+		} else if (key == "VARS" && !value.empty()) {
+			std::vector<std::string> variables;
+			boost::algorithm::split(variables, value, boost::is_any_of(" "), boost::token_compress_on);
+
+			for (const auto & variable : variables) {
+				auto colon{variable.find(':')};
+
+				if (colon == std::string::npos) {
+					throw std::invalid_argument{"malformed variable " + variable};
+				}
+
+				stored.variables.emplace_back(std::stoi(variable.substr(0, colon), nullptr, 16), std::stoi(variable.substr(colon + 1))); // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+			}
+		}
+	}
+
+	if (!has_seed || !has_frames) {
+		throw std::invalid_argument{"missing SEED or FRAMES"};
+	}
+
+	return stored;
+}
+
+// Returns the lines that differ between the two texts, from a longest common
+// subsequence of their lines, prefixed with '-' if only in the old text and '+'
+// if only in the new one. The ROSA line is ignored, so that a new build of rosa
+// alone does not count as a difference.
+auto diff_lines(const std::string & old_text, const std::string & new_text) -> std::string {
+	auto split_lines = [](const std::string & text) {
+		std::vector<std::string> lines;
+		std::istringstream input{text};
+		std::string line;
+
+		while (std::getline(input, line)) {
+			if (line.rfind("ROSA\t", 0) != 0) {
+				lines.push_back(line);
+			}
+		}
+
+		return lines;
+	};
+
+	auto old_lines{split_lines(old_text)};
+	auto new_lines{split_lines(new_text)};
+
+	std::vector<std::vector<std::size_t>> lengths(old_lines.size() + 1, std::vector<std::size_t>(new_lines.size() + 1, 0));
+
+	for (auto i{old_lines.size()}; i-- > 0;) {
+		for (auto j{new_lines.size()}; j-- > 0;) {
+			lengths[i][j] = old_lines[i] == new_lines[j] ? lengths[i + 1][j + 1] + 1 : std::max(lengths[i + 1][j], lengths[i][j + 1]);
+		}
+	}
+
+	std::string diff;
+	std::size_t i{0};
+	std::size_t j{0};
+
+	while (i < old_lines.size() || j < new_lines.size()) {
+		if (i < old_lines.size() && j < new_lines.size() && old_lines[i] == new_lines[j]) {
+			i++;
+			j++;
+		} else if (j == new_lines.size() || (i < old_lines.size() && lengths[i + 1][j] >= lengths[i][j + 1])) {
+			diff += "-" + old_lines[i++] + '\n';
+		} else {
+			diff += "+" + new_lines[j++] + '\n';
+		}
+	}
+
+	return diff;
+}
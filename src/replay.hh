@@ -0,0 +1,29 @@
+#ifndef ROSA_REPLAY_HH
+#define ROSA_REPLAY_HH
+
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A route previously generated by rosa, with the header fields needed to
+// simulate it again.
+struct StoredRoute {
+	std::string title;
+	int seed{0};
+	int maximum_extra_steps{0};
+	int maximum_step_segments{-1};
+	bool tas_mode{false};
+	bool prefer_fewer_locations{false};
+	int64_t frames{0};
+
+	std::vector<std::pair<int, int>> variables;
+
+	std::string text;
+};
+
+auto read_stored_route(std::istream & input) -> StoredRoute;
+auto diff_lines(const std::string & old_text, const std::string & new_text) -> std::string;
+
+#endif // ROSA_REPLAY_HH
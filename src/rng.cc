@@ -0,0 +1,57 @@
+#include "rng.hh"
+
+StepTable::StepTable(int encounter_rate) : _distances(RNG_CYCLE_LENGTH, 0), _counts(RNG_CYCLE_LENGTH + 1, 0) {
+	std::vector<bool> triggers(RNG_CYCLE_LENGTH, false);
+
+	for (int position{0}; position < RNG_CYCLE_LENGTH; position++) {
+		auto cycle_position{static_cast<uint16_t>(position)};
+		auto rng_index{static_cast<std::size_t>(get_cycle_index(cycle_position))};
+
+		triggers[static_cast<std::size_t>(position)] = (RNG_DATA.at(rng_index) + get_cycle_seed(cycle_position)) % RNG_SIZE < encounter_rate;
+		_counts[static_cast<std::size_t>(position) + 1] = _counts[static_cast<std::size_t>(position)] + (triggers[static_cast<std::size_t>(position)] ? 1 : 0);
+	}
+
+	if (_counts.back() == 0) {
+		return;
+	}
+
+	// Two passes backwards around the cycle ensure that positions after the
+	// last trigger find the first trigger after wrapping.
+	int distance{RNG_CYCLE_LENGTH};
+
+	for (int i{2 * RNG_CYCLE_LENGTH - 1}; i >= 0; i--) {
+		auto position{static_cast<std::size_t>(i % RNG_CYCLE_LENGTH)};
+		distance = triggers[position] ? 0 : distance + 1;
+
+		if (i < RNG_CYCLE_LENGTH) {
+			_distances[position] = static_cast<uint16_t>(distance);
+		}
+	}
+}
+
+// Returns the number of steps from the given position until the next step that
+// triggers an encounter, or -1 if no encounter occurs within the given number
+// of steps.
+auto StepTable::get_next_encounter(uint16_t position, int steps) const -> int {
+	if (_counts.back() == 0) {
+		return -1;
+	}
+
+	auto distance{static_cast<int>(_distances[static_cast<uint16_t>(position + 1)]) + 1};
+
+	return distance <= steps ? distance : -1;
+}
+
+// Returns the number of encounters triggered by the given number of steps from
+// the given position.
+auto StepTable::get_encounter_count(uint16_t position, int steps) const -> int {
+	auto count{static_cast<int>(steps / RNG_CYCLE_LENGTH) * static_cast<int>(_counts.back())};
+	auto begin{static_cast<std::size_t>(position) + 1};
+	auto end{begin + static_cast<std::size_t>(steps % RNG_CYCLE_LENGTH)};
+
+	if (end <= RNG_CYCLE_LENGTH) {
+		return count + static_cast<int>(_counts[end] - _counts[begin]);
+	}
+
+	return count + static_cast<int>(_counts.back() - _counts[begin] + _counts[end - RNG_CYCLE_LENGTH]);
+}
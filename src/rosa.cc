@@ -1,22 +1,57 @@
+#include <algorithm>
 #include <cstdlib>
+#include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/format.hpp>
 
+#include <unistd.h>
+
 #include "CLI/CLI.hpp"
 
 #include "encounter.hh"
 #include "engine.hh"
 #include "instruction.hh"
 #include "map.hh"
+#include "memory.hh"
 #include "options.hh"
 #include "parameters.hh"
+#include "replay.hh"
 #include "version.hh"
 
+/*
+ * Helper Functions
+ */
+
+// Parses a list of seeds in the form a-b,c,d-e...
+static auto parse_seeds(const std::string & text) -> std::vector<int> {
+	std::vector<std::string> ranges;
+	boost::algorithm::split(ranges, text, boost::is_any_of(","), boost::token_compress_on);
+
+	std::vector<int> seeds;
+
+	for (const auto & range : ranges) {
+		std::vector<std::string> values;
+		boost::algorithm::split(values, range, boost::is_any_of("-"));
+
+		auto minimum{std::stoi(values[0])};
+		auto maximum{values.size() > 1 ? std::stoi(values[1]) : minimum};
+
+		for (auto seed{minimum}; seed <= maximum; seed++) {
+			if (std::find(seeds.begin(), seeds.end(), seed) == seeds.end()) {
+				seeds.push_back(seed);
+			}
+		}
+	}
+
+	return seeds;
+}
+
 /*
  * Main Function
  */
@@ -36,14 +71,17 @@ auto main (int argc, char ** argv) -> int {
 
 	CLI::App app{std::string{"Rosa "} + std::string{ROSA_VERSION}};
 
-	std::map<std::string, CacheType> cache_type_map{{"dynamic", CacheType::Dynamic}, {"persistent", CacheType::Persistent}};
+	std::map<std::string, CacheType> cache_type_map{{"dynamic", CacheType::Dynamic}, {"mapped", CacheType::Mapped}, {"persistent", CacheType::Persistent}};
+	std::map<std::string, SolverType> solver_map{{"recursive", SolverType::Recursive}, {"iterative", SolverType::Iterative}};
+	std::map<std::string, OutputFormat> output_format_map{{"text", OutputFormat::Text}, {"json", OutputFormat::Json}};
 
 	app.add_option("-r,--route", options.route, "Route to process")
 		->capture_default_str();
 	app.add_option("-s,--seed", options.seed, "Seed to process")
 		->capture_default_str();
 	app.add_option("-m,--maximum-steps", options.maximum_steps, "Maximum number of extra steps per segment")
-		->capture_default_str();
+		->capture_default_str()
+		->check(CLI::Range(0, MAXIMUM_CACHE_VALUE));
 	app.add_option("-n,--maximum-step-segments", options.maximum_step_segments, "Maximum number of segments where extra steps can be taken");
 	app.add_option("-v,--variables", options.variables, "Explicitly set variable constraints in the form variable:value[-max_value]");
 
@@ -55,7 +93,32 @@ auto main (int argc, char ** argv) -> int {
 		->transform(CLI::CheckedTransformer(cache_type_map, CLI::ignore_case).description(CLI::detail::generate_map(CLI::detail::smart_deref(cache_type_map), true)));
 	app.add_option("-l,--cache-location", options.cache_location, "The location for the cache if using a persistent cache");
 	app.add_option("-f,--cache-filename", options.cache_filename, "The filename for the cache if using a persistent cache");
-	app.add_option("-x,--cache-size", options.cache_size, "The size of the temporary in-memory cache if using a persistent cache");
+	app.add_flag("--convert-cache", options.convert_cache, "Convert a persistent cache from an older format and exit");
+	app.add_option("-x,--cache-size", options.cache_size, "The memory available to the in-memory cache (e.g. 8G)");
+	app.add_option("--snapshot", options.snapshot, "A file to save the dynamic cache to periodically and to resume from if it exists");
+	app.add_option("--snapshot-interval", options.snapshot_interval, "The number of seconds between snapshots")
+		->capture_default_str();
+
+	app.add_option("-e,--solver", options.solver, "The solver used to optimize the route")
+		->capture_default_str()
+		->transform(CLI::CheckedTransformer(solver_map, CLI::ignore_case).description(CLI::detail::generate_map(CLI::detail::smart_deref(solver_map), true)));
+	app.add_option("-j,--threads", options.threads, "Number of threads to use with the iterative solver")
+		->capture_default_str();
+	app.add_flag("-b,--branch-and-bound", options.branch_and_bound, "Skip decisions that cannot beat the best result found so far");
+	app.add_flag("--low-memory", options.low_memory, "Only cache decisions at sparse checkpoints, recomputing the rest when generating the route");
+
+	app.add_option("-S,--seeds", options.seeds, "Process multiple seeds at once, in the form a-b,c,d-e...");
+	app.add_option("-o,--output-directory", options.output_directory, "The directory in which to write each route when processing multiple seeds");
+	app.add_option("--output-format", options.output_format, "The format of the generated routes")
+		->capture_default_str()
+		->transform(CLI::CheckedTransformer(output_format_map, CLI::ignore_case).description(CLI::detail::generate_map(CLI::detail::smart_deref(output_format_map), true)));
+	app.add_option("-M,--memory-limit", options.memory_limit, "The memory budget for the cache, moving cache entries to disk as it is approached (e.g. 24G)");
+	app.add_option("--replay", options.replay_files, "Simulate previously generated routes again and report any differences");
+	app.add_flag("--twins", options.twins, "Resolve the seed together with the following seed, its twin");
+	app.add_option("--twin-shared-until", options.twin_shared_until, "The route index before which twin seeds always share their decisions");
+	app.add_flag("--stats", options.statistics, "Report cache, search and timing statistics at the end of the run");
+	app.add_option("--stats-lines", options.statistics_lines, "The number of hottest route lines and variables to report with --stats")
+		->capture_default_str();
 
 	try {
 		app.parse(argc, argv);
@@ -63,6 +126,57 @@ auto main (int argc, char ** argv) -> int {
 		return app.exit(e);
 	}
 
+	std::vector<int> seeds;
+	std::size_t memory_limit{0};
+	std::size_t cache_size{options.cache_type == CacheType::Persistent ? PERSISTENT_CACHE_DEFAULT_SIZE : 0};
+
+	try {
+		if (!options.seeds.empty()) {
+			seeds = parse_seeds(options.seeds);
+		}
+
+		if (!options.memory_limit.empty()) {
+			memory_limit = parse_memory_size(options.memory_limit);
+		}
+
+		if (!options.cache_size.empty()) {
+			cache_size = parse_memory_size(options.cache_size);
+		}
+	} catch (...) {
+		std::cerr << "ERROR: Invalid seed list, memory limit or cache size\n";
+		return EXIT_FAILURE;
+	}
+
+	if (!seeds.empty() && options.output_directory.empty()) {
+		std::cerr << "ERROR: An output directory is required when processing multiple seeds\n";
+		return EXIT_FAILURE;
+	}
+
+	if (options.twins && !seeds.empty()) {
+		std::cerr << "ERROR: Twin seeds cannot be resolved when processing multiple seeds\n";
+		return EXIT_FAILURE;
+	}
+
+	if (options.threads > 1 && options.solver != SolverType::Iterative) {
+		std::cerr << "WARNING: Multiple threads require the iterative solver, which will be used instead\n";
+		options.solver = SolverType::Iterative;
+	}
+
+	if (options.low_memory && options.solver != SolverType::Iterative) {
+		std::cerr << "WARNING: Low memory mode requires the iterative solver, which will be used instead\n";
+		options.solver = SolverType::Iterative;
+	}
+
+	if (options.branch_and_bound && options.solver != SolverType::Recursive) {
+		std::cerr << "WARNING: Branch and bound is not supported by the iterative solver and will be ignored\n";
+		options.branch_and_bound = false;
+	}
+
+	if (!options.snapshot.empty() && options.cache_type != CacheType::Dynamic) {
+		std::cerr << "WARNING: Snapshots are only written for the dynamic cache and will be ignored\n";
+		options.snapshot.clear();
+	}
+
 	/*
 	 * Base Data
 	 */
@@ -77,6 +191,13 @@ auto main (int argc, char ** argv) -> int {
 
 	auto route{read_route(route_source_file)};
 
+	for (const auto & instruction : route) {
+		if (instruction.type == InstructionType::Search && !instruction.search->is_valid()) {
+			std::cerr << "ERROR: Search expression is invalid or has more than " << MAXIMUM_SEARCH_TERMS << " terms: " << instruction.source << '\n';
+			return EXIT_FAILURE;
+		}
+	}
+
 	std::string data_key{"ff2us"};
 
 	for (const auto & instruction : route) {
@@ -105,10 +226,70 @@ auto main (int argc, char ** argv) -> int {
 
 	Maps maps{maps_file};
 
+	/*
+	 * Replay
+	 */
+
+	if (!options.replay_files.empty()) {
+		if (!options.output_directory.empty()) {
+			std::filesystem::create_directories(options.output_directory);
+		}
+
+		for (const auto & filename : options.replay_files) {
+			std::ifstream stored_file{filename, std::ios_base::in};
+
+			if (!stored_file.is_open()) {
+				std::cerr << "ERROR: Failed to open " << filename << '\n';
+				return EXIT_FAILURE;
+			}
+
+			StoredRoute stored;
+
+			try {
+				stored = read_stored_route(stored_file);
+			} catch (...) {
+				std::cerr << "ERROR: " << filename << " is not a route generated by rosa\n";
+				return EXIT_FAILURE;
+			}
+
+			Engine engine{Parameters{route, encounters, maps, stored.maximum_extra_steps, stored.tas_mode, stored.prefer_fewer_locations, true, stored.maximum_step_segments, CacheType::Dynamic, "", 0, SolverType::Recursive, 1, false, false}};
+			auto output{engine.replay(stored.seed, stored.variables)};
+
+			if (!output) {
+				std::cout << filename << ": invalid, FRAMES " << stored.frames << '\n';
+				continue;
+			}
+
+			std::istringstream output_stream{*output};
+			auto replayed{read_stored_route(output_stream)};
+			auto diff{diff_lines(stored.text, *output)};
+
+			if (diff.empty()) {
+				std::cout << filename << ": unchanged, FRAMES " << replayed.frames << '\n';
+			} else {
+				std::cout << filename << ": changed, FRAMES " << stored.frames << " -> " << replayed.frames << '\n' << diff;
+			}
+
+			if (!options.output_directory.empty()) {
+				std::string output_filename{options.output_directory + "/" + std::filesystem::path{filename}.filename().string()};
+				std::ofstream output_file{output_filename, std::ios_base::out};
+
+				if (!output_file.is_open()) {
+					std::cerr << "ERROR: Failed to open " << output_filename << '\n';
+					return EXIT_FAILURE;
+				}
+
+				output_file << *output;
+			}
+		}
+
+		return EXIT_SUCCESS;
+	}
+
 	auto cache_type{options.cache_type};
 	auto cache_location{options.cache_filename};
 
-	if (cache_type == CacheType::Persistent) {
+	if (cache_type == CacheType::Persistent || cache_type == CacheType::Mapped) {
 		if (cache_location.empty()) {
 			if (options.cache_location.empty()) {
 				cache_location = "cache";
@@ -116,15 +297,64 @@ auto main (int argc, char ** argv) -> int {
 				cache_location = options.cache_location;
 			}
 
-			cache_location += (boost::format("/%s-%03d.mdb") % options.route % options.seed).str();
+			std::string extension{cache_type == CacheType::Persistent ? "mdb" : "map"};
+
+			if (seeds.empty()) {
+				cache_location += (boost::format("/%s-%03d.%s") % options.route % options.seed % extension).str();
+			} else {
+				cache_location += (boost::format("/%s.%s") % options.route % extension).str();
+			}
+		}
+	}
+
+	if (options.convert_cache) {
+		if (cache_type != CacheType::Persistent) {
+			std::cerr << "ERROR: Only a persistent cache can be converted\n";
+			return EXIT_FAILURE;
+		}
+
+		if (!PersistentCache::needs_conversion(cache_location)) {
+			std::cerr << "The cache database at " << cache_location << " does not need to be converted\n";
+			return EXIT_SUCCESS;
 		}
+
+		auto count{PersistentCache::convert(cache_location)};
+		std::cerr << "Converted " << count << " entries in " << cache_location << '\n';
+
+		return EXIT_SUCCESS;
+	}
+
+	if (cache_type == CacheType::Persistent && PersistentCache::needs_conversion(cache_location)) {
+		std::cerr << "ERROR: The cache database at " << cache_location << " uses an old format. Convert it with --convert-cache.\n";
+		return EXIT_FAILURE;
+	}
+
+	// With a memory limit, the in-memory cache is given half of what is left
+	// of it, which leaves the rest for the search itself. The limit only
+	// applies to the cache. A dynamic cache then moves the entries it evicts
+	// to an overflow store on disk, next to any cache location given. With
+	// only a cache size, it does so once it finds itself recomputing them.
+	std::string overflow_location;
+	bool overflow_for_thrashing{memory_limit == 0};
+
+	if (memory_limit > 0 && cache_type != CacheType::Mapped) {
+		auto resident_memory{get_resident_memory()};
+		auto budget{std::max<std::size_t>(1, memory_limit > resident_memory ? (memory_limit - resident_memory) / 2 : 0)};
+
+		cache_size = cache_size > 0 ? std::min(cache_size, budget) : budget;
+	}
+
+	if (cache_size > 0 && cache_type == CacheType::Dynamic) {
+		auto directory{options.cache_location.empty() ? std::filesystem::temp_directory_path() : std::filesystem::path{options.cache_location}};
+		overflow_location = (directory / (boost::format("rosa-overflow-%d") % getpid()).str()).string();
 	}
 
 	/*
 	 * Optimization
 	 */
 
-	Engine engine{Parameters{route, encounters, maps, options.maximum_steps, options.tas_mode, options.prefer_fewer_locations, options.variables.empty(), options.maximum_step_segments, cache_type, cache_location, options.cache_size}};
+	Engine engine{Parameters{route, encounters, maps, options.maximum_steps, options.tas_mode, options.prefer_fewer_locations, options.variables.empty(), options.maximum_step_segments, cache_type, cache_location, cache_size, options.solver, options.threads, options.branch_and_bound, options.low_memory, options.output_format, options.statistics, options.snapshot, Seconds{options.snapshot_interval}, overflow_location, overflow_for_thrashing}};
+	engine.check_encounter_data();
 
 	if (!options.variables.empty()) {
 		std::vector<std::string> variables;
@@ -146,6 +376,11 @@ auto main (int argc, char ** argv) -> int {
 					maximum = std::stoi(values[1]);
 				}
 
+				if (minimum < 0 || maximum > MAXIMUM_CACHE_VALUE) {
+					std::cerr << "ERROR: Variable values must be between 0 and " << MAXIMUM_CACHE_VALUE << ": " << variable << '\n';
+					return EXIT_FAILURE;
+				}
+
 				engine.set_variable_minimum(index, minimum);
 				engine.set_variable_maximum(index, maximum);
 			}
@@ -154,7 +389,124 @@ auto main (int argc, char ** argv) -> int {
 		}
 	}
 
-	std::cout << engine.optimize(options.seed);
+	if (options.twins) {
+		std::vector<int> twin_seeds{options.seed, (options.seed + 1) % RNG_SIZE};
+		auto routes{engine.optimize_twins(twin_seeds[0], twin_seeds[1], static_cast<std::size_t>(std::max(0, options.twin_shared_until)))};
+
+		if (!options.output_directory.empty()) {
+			std::filesystem::create_directories(options.output_directory);
+		}
+
+		for (std::size_t i{0}; i < twin_seeds.size(); i++) {
+			if (options.output_directory.empty()) {
+				std::cout << routes.outputs[i] << '\n';
+				continue;
+			}
+
+			std::string output_filename{(boost::format("%s/%03d.%s") % options.output_directory % twin_seeds[i] % (options.output_format == OutputFormat::Json ? "json" : "txt")).str()};
+			std::ofstream output_file{output_filename, std::ios_base::out};
+
+			if (!output_file.is_open()) {
+				std::cerr << "ERROR: Failed to open " << output_filename << '\n';
+				return EXIT_FAILURE;
+			}
+
+			output_file << routes.outputs[i];
+		}
+
+		Milliframes total_loss{0_mf};
+
+		for (std::size_t i{0}; i < twin_seeds.size(); i++) {
+			auto loss{routes.frames[i] - routes.independent_frames[i]};
+			total_loss += loss;
+
+			std::cout << boost::format("%-21s%0.3fs\n") % (boost::format("Seed %d Loss:") % twin_seeds[i]).str() % Seconds(loss).count();
+		}
+
+		std::cout << boost::format("%-21s%0.3fs\n") % "Combined Loss:" % Seconds(total_loss).count();
+		std::cerr << engine.get_statistics_report(options.statistics_lines);
+
+		return EXIT_SUCCESS;
+	}
+
+	if (seeds.empty()) {
+		std::cout << engine.optimize(options.seed);
+		std::cerr << engine.get_statistics_report(options.statistics_lines);
+
+		return EXIT_SUCCESS;
+	}
+
+	/*
+	 * Batch Optimization
+	 */
+
+	// Seeds are solved together in batches that share states, the cache and
+	// the thread pool. The most expensive seeds are started first, and each
+	// batch is sized from the memory used by earlier ones, to stay within the
+	// memory limit, or without one, the physical memory.
+	std::vector<std::pair<std::size_t, int>> costs;
+
+	for (const auto & seed : seeds) {
+		costs.emplace_back(engine.estimate_cost(seed), seed);
+	}
+
+	std::stable_sort(costs.begin(), costs.end(), [](const auto & a, const auto & b) { return a.first > b.first; });
+	std::transform(costs.begin(), costs.end(), seeds.begin(), [](const auto & cost) { return cost.second; });
+
+	std::filesystem::create_directories(options.output_directory);
+
+	// As JSON, every seed is written as one line of a single file for the route,
+	// as soon as its batch is complete.
+	std::ofstream results_file;
+
+	if (options.output_format == OutputFormat::Json) {
+		std::string results_filename{(boost::format("%s/%s.jsonl") % options.output_directory % options.route).str()};
+		results_file.open(results_filename, std::ios_base::out);
+
+		if (!results_file.is_open()) {
+			std::cerr << "ERROR: Failed to open " << results_filename << '\n';
+			return EXIT_FAILURE;
+		}
+	}
+
+	std::size_t batch_memory{memory_limit > 0 ? memory_limit : get_physical_memory()};
+	std::size_t batch_size{batch_memory > 0 ? 1 : seeds.size()};
+	std::size_t initial_memory{get_resident_memory()};
+
+	for (std::size_t next{0}; next < seeds.size();) {
+		std::vector<int> batch{seeds.begin() + static_cast<std::ptrdiff_t>(next), seeds.begin() + static_cast<std::ptrdiff_t>(std::min(seeds.size(), next + batch_size))};
+		auto outputs{engine.optimize(batch)};
+
+		for (std::size_t i{0}; i < batch.size(); i++) {
+			if (results_file.is_open()) {
+				results_file << outputs[i] << std::flush;
+				std::cerr << "Seed " << batch[i] << " complete\n";
+				continue;
+			}
+
+			std::string output_filename{(boost::format("%s/%03d.txt") % options.output_directory % batch[i]).str()};
+			std::ofstream output_file{output_filename, std::ios_base::out};
+
+			if (!output_file.is_open()) {
+				std::cerr << "ERROR: Failed to open " << output_filename << '\n';
+				return EXIT_FAILURE;
+			}
+
+			output_file << outputs[i];
+			std::cerr << "Seed " << batch[i] << " complete\n";
+		}
+
+		next += batch.size();
+
+		if (batch_memory > 0) {
+			auto memory{std::max(get_resident_memory(), get_peak_memory())};
+			auto seed_memory{std::max<std::size_t>(1, (memory > initial_memory ? memory - initial_memory : 0) / next)};
+
+			batch_size = memory < batch_memory ? std::max<std::size_t>(1, (batch_memory - memory) / seed_memory) : 1;
+		}
+	}
+
+	std::cerr << engine.get_statistics_report(options.statistics_lines);
 
 	return EXIT_SUCCESS;
 }
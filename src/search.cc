@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <iostream>
+
+#include "search.hh"
+
+SearchAutomaton::SearchAutomaton() : _complete{0} {}
+
+SearchAutomaton::SearchAutomaton(const std::shared_ptr<const peg::Ast> & expression, const std::vector<int> & targets) : SearchAutomaton() {
+	if (targets.size() > MAXIMUM_SEARCH_TERMS) {
+		return;
+	}
+
+	std::vector<int> encounter_ids;
+
+	for (const auto & target : targets) {
+		auto encounter_id{static_cast<std::size_t>(target)};
+
+		if (encounter_id >= _symbols.size()) {
+			_symbols.resize(encounter_id + 1, -1);
+		}
+
+		if (_symbols[encounter_id] < 0) {
+			_symbols[encounter_id] = static_cast<int>(encounter_ids.size());
+			encounter_ids.push_back(target);
+		}
+	}
+
+	if (targets.size() > MAXIMUM_COMPILED_SEARCH_TERMS) {
+		_expression = expression;
+		_targets = targets;
+		return;
+	}
+
+	auto state_count{std::size_t{1} << targets.size()};
+
+	_shift = static_cast<unsigned int>(MAXIMUM_SEARCH_TERMS - targets.size());
+	_symbol_count = encounter_ids.size();
+	_transitions.resize(state_count * _symbol_count);
+	_complete.resize(state_count);
+
+	for (std::size_t state{0}; state < state_count; state++) {
+		auto values{static_cast<uint64_t>(state) << _shift};
+
+		_complete[state] = _check_complete(values, *expression) ? 1 : 0;
+
+		for (std::size_t symbol{0}; symbol < _symbol_count; symbol++) {
+			auto next_values{values};
+
+			if (_complete[state] == 0) {
+				_assign_encounter(&next_values, targets, static_cast<std::size_t>(encounter_ids[symbol]), *expression);
+			}
+
+			_transitions[state * _symbol_count + symbol] = static_cast<uint16_t>(next_values >> _shift);
+		}
+	}
+}
+
+// Advances the search on an encounter by walking the parse tree, for an
+// expression with too many terms for a table.
+auto SearchAutomaton::_evaluate(uint64_t values, std::size_t encounter_id) const -> std::pair<uint64_t, bool> {
+	if (!_check_complete(values, *_expression)) {
+		_assign_encounter(&values, _targets, encounter_id, *_expression);
+	}
+
+	return std::make_pair(values, _check_complete(values, *_expression));
+}
+
+auto SearchAutomaton::_check_complete(uint64_t values, const peg::Ast & expression) -> bool {
+	using peg::udl::operator""_;
+
+	switch (expression.tag) {
+		case "disjunction"_:
+			return std::any_of(expression.nodes.begin(), expression.nodes.end(), [values](const auto & node){ return _check_complete(values, *node); });
+		case "conjunction"_:
+		case "sequence"_:
+			return std::all_of(expression.nodes.begin(), expression.nodes.end(), [values](const auto & node){ return _check_complete(values, *node); });
+		case "number"_:
+			return (values & get_search_value_bit(expression.token_to_number<std::size_t>())) != 0;
+		default:
+			std::cerr << "BUG: Unimplemented tag in _check_complete. Please report this." << std::endl;
+			break;
+	}
+
+	return false;
+}
+
+auto SearchAutomaton::_assign_encounter(uint64_t * values, const std::vector<int> & targets, std::size_t encounter_id, const peg::Ast & expression) -> bool {
+	using peg::udl::operator""_;
+
+	switch (expression.tag) {
+		case "conjunction"_:
+			for (const auto & node : expression.nodes) {
+				if (!_check_complete(*values, *node)) {
+					if (_assign_encounter(values, targets, encounter_id, *node)) {
+						return true;
+					}
+				}
+			}
+
+			break;
+		case "disjunction"_:
+			for (const auto & node : expression.nodes) {
+				_assign_encounter(values, targets, encounter_id, *node);
+			}
+
+			break;
+		case "number"_: {
+			auto number = expression.token_to_number<std::size_t>();
+			auto bit{get_search_value_bit(number)};
+
+			if ((*values & bit) == 0 && static_cast<std::size_t>(targets.at(number)) == encounter_id) {
+				*values |= bit;
+				return true;
+			}
+
+			break;
+		}
+		case "sequence"_:
+			for (const auto & node: expression.nodes) {
+				if (!_check_complete(*values, *node)) {
+					return _assign_encounter(values, targets, encounter_id, *node);
+				}
+			}
+
+			break;
+		default:
+			std::cerr << "BUG: Unimplemented tag in _assign_encounter. Please report this." << std::endl;
+			break;
+	}
+
+	return false;
+}
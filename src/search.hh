@@ -0,0 +1,73 @@
+#ifndef ROSA_SEARCH_HH
+#define ROSA_SEARCH_HH
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "peglib.h"
+
+constexpr std::size_t MAXIMUM_SEARCH_TERMS = 48;
+constexpr std::size_t MAXIMUM_COMPILED_SEARCH_TERMS = 16;
+
+// Search progress is a mask with one bit per term of the expression. The first
+// term is stored in the most significant of the 48 bits.
+constexpr auto get_search_value_bit(std::size_t term) -> uint64_t {
+	return 1ULL << (MAXIMUM_SEARCH_TERMS - 1 - term);
+}
+
+// A SEARCH expression compiled into a transition table. Every combination of
+// the expression's terms is a state of the automaton and every distinct
+// encounter in the expression is a symbol, so advancing the search on an
+// encounter is a single table lookup. The table has a state for every
+// combination, so an expression with more than MAXIMUM_COMPILED_SEARCH_TERMS
+// terms is instead evaluated from its parse tree on each encounter, which
+// supports up to MAXIMUM_SEARCH_TERMS. An automaton that is default
+// constructed, or given more terms than that, is invalid and never completes.
+class SearchAutomaton {
+	public:
+		SearchAutomaton();
+		SearchAutomaton(const std::shared_ptr<const peg::Ast> & expression, const std::vector<int> & targets);
+
+		[[nodiscard]] auto is_compiled() const -> bool {
+			return !_transitions.empty();
+		}
+
+		[[nodiscard]] auto is_valid() const -> bool {
+			return is_compiled() || _expression;
+		}
+
+		[[nodiscard]] auto advance(uint64_t values, std::size_t encounter_id) const -> std::pair<uint64_t, bool> {
+			if (encounter_id >= _symbols.size() || _symbols[encounter_id] < 0) {
+				return std::make_pair(values, false);
+			}
+
+			if (!is_compiled()) {
+				return _evaluate(values, encounter_id);
+			}
+
+			auto state{static_cast<std::size_t>(values >> _shift)};
+			auto next{_transitions[state * _symbol_count + static_cast<std::size_t>(_symbols[encounter_id])]};
+
+			return std::make_pair(static_cast<uint64_t>(next) << _shift, _complete[next] != 0);
+		}
+
+	private:
+		static auto _check_complete(uint64_t values, const peg::Ast & expression) -> bool;
+		static auto _assign_encounter(uint64_t * values, const std::vector<int> & targets, std::size_t encounter_id, const peg::Ast & expression) -> bool;
+
+		auto _evaluate(uint64_t values, std::size_t encounter_id) const -> std::pair<uint64_t, bool>;
+
+		unsigned int _shift{MAXIMUM_SEARCH_TERMS};
+		std::size_t _symbol_count{0};
+
+		std::vector<int> _symbols;
+		std::vector<uint16_t> _transitions;
+		std::vector<uint8_t> _complete;
+
+		std::shared_ptr<const peg::Ast> _expression;
+		std::vector<int> _targets;
+};
+
+#endif // ROSA_SEARCH_HH
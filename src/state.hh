@@ -1,60 +1,178 @@
 #ifndef ROSA_STATE_HH
 #define ROSA_STATE_HH
 
-#include <array>
+#include <cstdint>
+#include <tuple>
+#include <utility>
 
-#include "peglib.h"
-
-#include "map.hh"
 #include "party.hh"
+#include "rng.hh"
+#include "search.hh"
+
+constexpr uint16_t NO_SEARCH = UINT16_MAX;
+
+// A State is trivially copyable and holds its cache key directly, so that the
+// fields that form the key are updated in place as the state changes and
+// get_keys() costs nothing. The layout of the key is:
+//
+//   key1: party key (16) | remaining segments (16) | step seed (8) |
+//         step index (8) | encounter seed (8) | encounter index (8)
+//   key2: route index (16) | search values (48)
+//   key3: party key (64)
+//
+// Search values are stored with the first term in the most significant bit.
+class State {
+	public:
+		State() = default;
+		explicit State(int seed) {
+			set_step_position(get_cycle_position(seed, 0));
+			_key1 |= static_cast<uint64_t>((seed * 2) % RNG_SIZE) << ENCOUNTER_SEED_SHIFT;
+		}
+
+		[[nodiscard]] auto get_index() const -> std::size_t {
+			return static_cast<std::size_t>(_key2 >> INDEX_SHIFT);
+		}
+
+		void set_index(std::size_t index) {
+			_key2 = (_key2 & SEARCH_VALUES_MASK) | (static_cast<uint64_t>(index) << INDEX_SHIFT);
+		}
+
+		[[nodiscard]] auto get_remaining_segments() const -> uint16_t {
+			return static_cast<uint16_t>(_key1 >> REMAINING_SEGMENTS_SHIFT);
+		}
+
+		void set_remaining_segments(uint16_t remaining_segments) {
+			_key1 = (_key1 & ~(FIELD16_MASK << REMAINING_SEGMENTS_SHIFT)) | (static_cast<uint64_t>(remaining_segments) << REMAINING_SEGMENTS_SHIFT);
+		}
+
+		[[nodiscard]] auto get_step_position() const -> uint16_t {
+			return get_cycle_position(get_step_seed(), get_step_index());
+		}
+
+		void set_step_position(uint16_t position) {
+			auto step{(static_cast<uint64_t>(get_cycle_seed(position)) << FIELD8_BITS) | static_cast<uint64_t>(get_cycle_index(position))};
+			_key1 = (_key1 & ~(FIELD16_MASK << STEP_SHIFT)) | (step << STEP_SHIFT);
+		}
+
+		[[nodiscard]] auto get_step_seed() const -> int {
+			return static_cast<int>((_key1 >> (STEP_SHIFT + FIELD8_BITS)) & FIELD8_MASK);
+		}
+
+		[[nodiscard]] auto get_step_index() const -> int {
+			return static_cast<int>((_key1 >> STEP_SHIFT) & FIELD8_MASK);
+		}
+
+		[[nodiscard]] auto get_encounter_seed() const -> int {
+			return static_cast<int>((_key1 >> ENCOUNTER_SEED_SHIFT) & FIELD8_MASK);
+		}
+
+		[[nodiscard]] auto get_encounter_index() const -> int {
+			return static_cast<int>(_key1 & FIELD8_MASK);
+		}
+
+		void advance_encounter() {
+			auto encounter_index{(get_encounter_index() + 1) % RNG_SIZE};
+			auto encounter_seed{get_encounter_seed()};
+
+			if (encounter_index == 0) {
+				encounter_seed = (encounter_seed + SEED_UPDATE_DELTA) % RNG_SIZE;
+			}
 
-struct State {
-	int step_seed{0}; // NOLINT(misc-non-private-member-variables-in-classes)
-	int step_index{0}; // NOLINT(misc-non-private-member-variables-in-classes)
+			_key1 = (_key1 & ~FIELD16_MASK) | (static_cast<uint64_t>(encounter_seed) << ENCOUNTER_SEED_SHIFT) | static_cast<uint64_t>(encounter_index);
+		}
+
+		[[nodiscard]] auto get_party() const -> uint16_t {
+			return _party;
+		}
+
+		void set_party(const Parties & parties, uint16_t id) {
+			const auto [party_key1, party_key2] = parties.get_party(id).get_keys();
+
+			_party = id;
+			_key1 = (_key1 & ~(FIELD16_MASK << PARTY_SHIFT)) | (static_cast<uint64_t>(party_key1) << PARTY_SHIFT);
+			_key3 = party_key2;
+		}
+
+		[[nodiscard]] auto get_search() const -> uint16_t {
+			return _search;
+		}
+
+		[[nodiscard]] auto get_search_values() const -> uint64_t {
+			return _key2 & SEARCH_VALUES_MASK;
+		}
+
+		void set_search_values(uint64_t values) {
+			_key2 = (_key2 & ~SEARCH_VALUES_MASK) | (values & SEARCH_VALUES_MASK);
+		}
 
-	int encounter_seed{(step_seed * 2) % (UINT8_MAX + 1)}; // NOLINT(misc-non-private-member-variables-in-classes)
-	int encounter_index{0}; // NOLINT(misc-non-private-member-variables-in-classes)
+		[[nodiscard]] auto is_search_active() const -> bool {
+			return _search != NO_SEARCH;
+		}
 
-	int segment_encounters{0}; // NOLINT(misc-non-private-member-variables-in-classes)
+		[[nodiscard]] auto is_search_complete() const -> bool {
+			return _search_complete;
+		}
 
-	std::size_t index{0}; // NOLINT(misc-non-private-member-variables-in-classes)
+		void start_search(uint16_t search) {
+			_search = search;
+			_search_complete = false;
+			set_search_values(0);
+		}
 
-	uint16_t remaining_segments{std::numeric_limits<uint16_t>::max()}; // NOLINT(misc-non-private-member-variables-in-classes)
+		void complete_search() {
+			_search_complete = true;
+		}
 
-	Party party{""}; // NOLINT(misc-non-private-member-variables-in-classes)
-	Party search_party{""}; // NOLINT(misc-non-private-member-variables-in-classes)
+		void end_search() {
+			_search = NO_SEARCH;
+		}
 
-	std::shared_ptr<peg::Ast> search_expression{}; // NOLINT(misc-non-private-member-variables-in-classes)
-	std::vector<std::size_t> search_targets{}; // NOLINT(misc-non-private-member-variables-in-classes)
-	std::array<bool, 48> search_values{false}; // NOLINT(misc-non-private-member-variables-in-classes,cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-	bool search_active{false}; // NOLINT(misc-non-private-member-variables-in-classes)
-	bool search_complete{false}; // NOLINT(misc-non-private-member-variables-in-classes)
+		[[nodiscard]] auto has_segment_encounters() const -> bool {
+			return _segment_encounters;
+		}
 
-	[[nodiscard]] auto get_keys() const -> std::tuple<uint64_t, uint64_t, uint64_t> {
-		const auto [party_key1, party_key2] = party.get_keys();
+		void set_segment_encounters(bool segment_encounters) {
+			_segment_encounters = segment_encounters;
+		}
 
-		uint64_t key1{static_cast<uint64_t>(party_key1) << 48U}; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-		uint64_t key2{static_cast<uint64_t>(0)};
-		uint64_t key3{static_cast<uint64_t>(party_key2)};
+		[[nodiscard]] auto get_keys() const -> std::tuple<uint64_t, uint64_t, uint64_t> {
+			return std::make_tuple(_key1, _key2, _key3);
+		}
 
-		key1 += static_cast<uint64_t>(remaining_segments) << 32U; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-		key1 += static_cast<uint64_t>(step_seed) << 24U; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-		key1 += static_cast<uint64_t>(step_index) << 16U; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-		key1 += static_cast<uint64_t>(encounter_seed) << 8U; // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
-		key1 += static_cast<uint64_t>(encounter_index);
+		// Within one engine a party ID identifies the party keys, so replacing
+		// the party key in the first word with the ID gives a complete key in
+		// two words. It is only meaningful to caches that do not outlive the
+		// engine.
+		[[nodiscard]] auto get_packed_keys() const -> std::pair<uint64_t, uint64_t> {
+			return std::make_pair((_key1 & ~(FIELD16_MASK << PARTY_SHIFT)) | (static_cast<uint64_t>(_party) << PARTY_SHIFT), _key2);
+		}
 
-		for (const auto & value : search_values) {
-			key2 = (key2 << 1U) + static_cast<uint64_t>(value ? 1 : 0);
+		auto operator==(const State & other) const -> bool {
+			return get_keys() == other.get_keys();
 		}
 
-		key2 += static_cast<uint64_t>(index) << 48U; // NOLINT: readability-magic-numbers
+	private:
+		static constexpr unsigned int FIELD8_BITS = 8;
+		static constexpr uint64_t FIELD8_MASK = 0xFF;
+		static constexpr uint64_t FIELD16_MASK = 0xFFFF;
+
+		static constexpr unsigned int PARTY_SHIFT = 48;
+		static constexpr unsigned int REMAINING_SEGMENTS_SHIFT = 32;
+		static constexpr unsigned int STEP_SHIFT = 16;
+		static constexpr unsigned int ENCOUNTER_SEED_SHIFT = 8;
+
+		static constexpr unsigned int INDEX_SHIFT = 48;
+		static constexpr uint64_t SEARCH_VALUES_MASK = (1ULL << MAXIMUM_SEARCH_TERMS) - 1;
+
+		uint64_t _key1{FIELD16_MASK << REMAINING_SEGMENTS_SHIFT};
+		uint64_t _key2{0};
+		uint64_t _key3{0};
 
-		return std::make_tuple(key1, key2, key3);
-	}
+		uint16_t _party{0};
+		uint16_t _search{NO_SEARCH};
 
-	auto operator==(const State & other) const -> bool {
-		return get_keys() == other.get_keys();
-	}
+		bool _search_complete{false};
+		bool _segment_encounters{false};
 };
 
 #endif // ROSA_STATE_HH
@@ -0,0 +1,153 @@
+#include "thread_pool.hh"
+
+const std::size_t CHUNKS_PER_THREAD = 8;
+
+// Each thread pushes to and pops from the back of its own queue, and steals
+// from the front of the others when it runs dry. Threads that do not belong to
+// the pool share the first queue.
+static thread_local const ThreadPool * current_pool{nullptr};
+static thread_local std::size_t current_index{0};
+
+ThreadPool::ThreadPool(std::size_t threads) {
+	if (threads == 0) {
+		threads = 1;
+	}
+
+	for (std::size_t i{0}; i < threads; i++) {
+		_queues.push_back(std::make_unique<Queue>());
+	}
+
+	for (std::size_t i{1}; i < threads; i++) {
+		_threads.emplace_back(&ThreadPool::_work, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock{_mutex};
+		_stopping = true;
+	}
+
+	_condition.notify_all();
+
+	for (auto & thread : _threads) {
+		thread.join();
+	}
+}
+
+// Runs function for every index below count and waits for all of them to
+// finish. The calling thread executes tasks while it waits, so this may safely
+// be called from within another task, and only sleeps once none are queued.
+void ThreadPool::parallel_for(std::size_t count, const std::function<void(std::size_t)> & function) {
+	if (count == 0) {
+		return;
+	}
+
+	if (_queues.size() == 1 || count == 1) {
+		for (std::size_t i{0}; i < count; i++) {
+			function(i);
+		}
+
+		return;
+	}
+
+	auto chunks{std::min(count, _queues.size() * CHUNKS_PER_THREAD)};
+	auto chunk_size{(count + chunks - 1) / chunks};
+	std::atomic<std::size_t> remaining{0};
+
+	for (std::size_t begin{0}; begin < count; begin += chunk_size) {
+		auto end{std::min(count, begin + chunk_size)};
+		remaining++;
+
+		_push([this, &function, &remaining, begin, end]() {
+			for (auto i{begin}; i < end; i++) {
+				function(i);
+			}
+
+			if (--remaining == 0) {
+				std::lock_guard<std::mutex> lock{_mutex};
+				_condition.notify_all();
+			}
+		});
+	}
+
+	while (remaining > 0) {
+		if (_run_one()) {
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock{_mutex};
+		_condition.wait(lock, [this, &remaining]() { return remaining == 0 || _queued > 0; });
+	}
+}
+
+auto ThreadPool::get_size() const -> std::size_t {
+	return _queues.size();
+}
+
+void ThreadPool::_push(std::function<void()> task) {
+	auto index{current_pool == this ? current_index : 0};
+
+	{
+		std::lock_guard<std::mutex> lock{_queues[index]->mutex};
+		_queues[index]->tasks.push_back(std::move(task));
+	}
+
+	_queued++;
+
+	// A thread that has just found nothing queued is either still holding the
+	// lock or already waiting, so taking it here ensures it is woken.
+	{
+		std::lock_guard<std::mutex> lock{_mutex};
+	}
+
+	_condition.notify_one();
+}
+
+auto ThreadPool::_run_one() -> bool {
+	auto index{current_pool == this ? current_index : 0};
+	std::function<void()> task;
+
+	for (std::size_t i{0}; i < _queues.size() && !task; i++) {
+		auto & queue{*_queues[(index + i) % _queues.size()]};
+		std::lock_guard<std::mutex> lock{queue.mutex};
+
+		if (!queue.tasks.empty()) {
+			if (i == 0) {
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+			} else {
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+			}
+		}
+	}
+
+	if (!task) {
+		return false;
+	}
+
+	_queued--;
+	task();
+
+	return true;
+}
+
+void ThreadPool::_work(std::size_t index) {
+	current_pool = this;
+	current_index = index;
+
+	while (true) {
+		if (_run_one()) {
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock{_mutex};
+
+		if (_stopping) {
+			break;
+		}
+
+		_condition.wait(lock, [this]() { return _stopping || _queued > 0; });
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef ROSA_THREAD_POOL_HH
+#define ROSA_THREAD_POOL_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+	public:
+		explicit ThreadPool(std::size_t threads);
+		ThreadPool(const ThreadPool &) = delete;
+		ThreadPool(const ThreadPool &&) = delete;
+		auto operator=(const ThreadPool &) -> ThreadPool & = delete;
+		auto operator=(const ThreadPool &&) -> ThreadPool & = delete;
+
+		~ThreadPool();
+
+		void parallel_for(std::size_t count, const std::function<void(std::size_t)> & function);
+
+		[[nodiscard]] auto get_size() const -> std::size_t;
+
+	private:
+		struct Queue {
+			std::mutex mutex;
+			std::deque<std::function<void()>> tasks;
+		};
+
+		void _push(std::function<void()> task);
+		auto _run_one() -> bool;
+		void _work(std::size_t index);
+
+		std::vector<std::unique_ptr<Queue>> _queues;
+		std::vector<std::thread> _threads;
+
+		std::mutex _mutex;
+		std::condition_variable _condition;
+		std::atomic<std::size_t> _queued{0};
+		bool _stopping{false};
+};
+
+#endif // ROSA_THREAD_POOL_HH